@@ -1,6 +1,18 @@
 #ifndef INTERPOSE_H
 #define INTERPOSE_H
 
+#include <dlfcn.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
 #ifdef __APPLE__
 #define DYLD_INTERPOSE(_replacment, _replacee)                                 \
     __attribute__((used)) static struct {                                      \
@@ -9,15 +21,290 @@
     } _interpose_##_replacee __attribute__((section("__DATA,__interpose")))    \
     = {(const void*) (unsigned long) &_replacment,                             \
        (const void*) (unsigned long) &_replacee}
-#define GET_REAL_FUNCTION(NAME) ::NAME
 #define INTERPOSE_FUNCTION_NAME(NAME) interpose_##NAME##__
 #define INTERPOSE(NAME) DYLD_INTERPOSE(INTERPOSE_FUNCTION_NAME(NAME), NAME)
 #else
-#include <dlfcn.h>
-#define GET_REAL_FUNCTION(NAME)                                                \
-    (reinterpret_cast<decltype(::NAME)*>(dlsym(RTLD_NEXT, #NAME)))
 #define INTERPOSE_FUNCTION_NAME(NAME) NAME
 #define INTERPOSE(NAME)
 #endif
 
+// Interposers call the real allocation functions through interpose::real.
+//
+// On Linux, these are found with dlsym, which may itself allocate (dlerror
+// buffers, for instance), and so may come back to the interposers before it
+// returns. Allocations made while this thread resolves symbols are served by a
+// small bootstrap bump allocator instead, whose memory is never reused: freeing
+// it does nothing, and reallocating it moves it to the real allocator. Symbols
+// are resolved eagerly, before other constructors run, so that the hot path is
+// a plain load and test of the function pointer.
+//
+// Tools must interpose free and realloc whenever they interpose an allocation
+// function, so that bootstrap memory never reaches the real allocator.
+//
+// On macOS, calls from the interposing image are not interposed, so the real
+// functions are called directly.
+
+namespace interpose {
+namespace bootstrap {
+constexpr std::size_t kArenaSize = std::size_t(1) << 16;
+
+alignas(std::max_align_t) inline std::array<char, kArenaSize> arena;
+inline std::atomic_size_t used = 0;
+
+// Each block is preceded by its size. Returns nullptr once the arena is full.
+// This function CANNOT call any memory allocation functions.
+inline void* allocate(std::size_t size, std::size_t alignment) {
+    alignment = std::max(alignment, alignof(std::max_align_t));
+    if ((alignment & (alignment - 1)) != 0) {
+        return nullptr;
+    }
+
+    const auto base = reinterpret_cast<std::uintptr_t>(arena.data());
+    auto offset = used.load(std::memory_order_relaxed);
+    std::size_t begin = 0;
+    do {
+        const auto address = base + offset + sizeof(std::size_t);
+        begin = ((address + alignment - 1) & ~(alignment - 1)) - base;
+        if (begin > kArenaSize || size > kArenaSize - begin) {
+            return nullptr;
+        }
+    } while (!used.compare_exchange_weak(offset, begin + size,
+                                         std::memory_order_relaxed));
+
+    std::memcpy(&arena[begin - sizeof(std::size_t)], &size, sizeof(size));
+    return &arena[begin];
+}
+
+inline bool owns(const void* pointer) {
+    const auto* bytes = static_cast<const char*>(pointer);
+    return bytes >= arena.data() && bytes < arena.data() + kArenaSize;
+}
+
+inline std::size_t sizeOf(const void* pointer) {
+    std::size_t size = 0;
+    std::memcpy(&size, static_cast<const char*>(pointer) - sizeof(size),
+                sizeof(size));
+    return size;
+}
+} // namespace bootstrap
+
+namespace detail {
+inline thread_local bool resolving = false;
+
+// A function of the next object in the search order. Constant-initialized, so
+// function-local instances need no guard. Optional functions, which older C
+// libraries lack, may be missing instead of aborting the program.
+template <typename Function>
+class Symbol {
+  public:
+    explicit constexpr Symbol(const char* name, bool optional = false)
+        : name(name), optional(optional) {}
+
+    // Returns nullptr while this thread is resolving symbols, and for missing
+    // optional functions.
+    Function* get() {
+        auto* function = address.load(std::memory_order_acquire);
+        if (function == nullptr) [[unlikely]] {
+            function = resolve();
+        }
+        return function;
+    }
+
+  private:
+    Function* resolve() {
+        if (resolving || missing.load(std::memory_order_relaxed)) {
+            return nullptr;
+        }
+
+        resolving = true;
+        auto* function = reinterpret_cast<Function*>(dlsym(RTLD_NEXT, name));
+        resolving = false;
+        if (function == nullptr && optional) {
+            missing.store(true, std::memory_order_relaxed);
+            return nullptr;
+        }
+        if (function == nullptr) {
+            // There is nothing to forward to (a static executable, or a
+            // missing symbol), and no way to allocate an error message.
+            for (const char* text : {"interpose: could not resolve ", name,
+                                     static_cast<const char*>("\n")}) {
+                [[maybe_unused]] const auto written
+                    = write(STDERR_FILENO, text, std::strlen(text));
+            }
+            std::abort();
+        }
+        address.store(function, std::memory_order_release);
+        return function;
+    }
+
+    const char* name;
+    bool optional;
+    std::atomic<Function*> address = nullptr;
+    std::atomic_bool missing = false;
+};
+
+#ifndef __APPLE__
+// Spelled out: the attributes of the declarations would be ignored anyway.
+inline constinit Symbol<void*(std::size_t)> nextMalloc{"malloc"};
+inline constinit Symbol<void(void*)> nextFree{"free"};
+inline constinit Symbol<void*(std::size_t, std::size_t)> nextCalloc{"calloc"};
+inline constinit Symbol<void*(void*, std::size_t)> nextRealloc{"realloc"};
+inline constinit Symbol<void*(void*, std::size_t, std::size_t)>
+    nextReallocarray{"reallocarray", true};
+inline constinit Symbol<int(void**, std::size_t, std::size_t)>
+    nextPosixMemalign{"posix_memalign"};
+inline constinit Symbol<void*(std::size_t, std::size_t)> nextAlignedAlloc{
+    "aligned_alloc", true};
+
+// Runs before the constructors of the tools, which allocate.
+__attribute__((constructor(101))) static void resolveEagerly() {
+    nextMalloc.get();
+    nextFree.get();
+    nextCalloc.get();
+    nextRealloc.get();
+    nextReallocarray.get();
+    nextPosixMemalign.get();
+    nextAlignedAlloc.get();
+}
+#endif
+} // namespace detail
+
+namespace real {
+#ifdef __APPLE__
+// The address of the real malloc, to find which object it comes from.
+inline void* mallocAddress() {
+    return reinterpret_cast<void*>(&::malloc);
+}
+
+inline void* malloc(std::size_t size) {
+    return ::malloc(size);
+}
+
+inline void free(void* pointer) {
+    ::free(pointer);
+}
+
+inline void* calloc(std::size_t n, std::size_t size) {
+    return ::calloc(n, size);
+}
+
+inline void* realloc(void* pointer, std::size_t size) {
+    return ::realloc(pointer, size);
+}
+
+inline int posix_memalign(void** memptr, std::size_t alignment,
+                          std::size_t size) {
+    return ::posix_memalign(memptr, alignment, size);
+}
+
+inline void* aligned_alloc(std::size_t alignment, std::size_t size) {
+    return ::aligned_alloc(alignment, size);
+}
+#else
+inline void* mallocAddress() {
+    return reinterpret_cast<void*>(detail::nextMalloc.get());
+}
+
+inline void* malloc(std::size_t size) {
+    auto* next = detail::nextMalloc.get();
+    if (next == nullptr) [[unlikely]] {
+        return bootstrap::allocate(size, alignof(std::max_align_t));
+    }
+    return next(size);
+}
+
+inline void free(void* pointer) {
+    if (bootstrap::owns(pointer)) [[unlikely]] {
+        return;
+    }
+    // Memory freed while resolving symbols is leaked.
+    auto* next = detail::nextFree.get();
+    if (next != nullptr) [[likely]] {
+        next(pointer);
+    }
+}
+
+inline void* calloc(std::size_t n, std::size_t size) {
+    auto* next = detail::nextCalloc.get();
+    if (next == nullptr) [[unlikely]] {
+        std::size_t bytes = 0;
+        if (__builtin_mul_overflow(n, size, &bytes)) {
+            return nullptr;
+        }
+        // The arena is zero-initialized and never reused.
+        return bootstrap::allocate(bytes, alignof(std::max_align_t));
+    }
+    return next(n, size);
+}
+
+inline void* realloc(void* pointer, std::size_t size) {
+    if (bootstrap::owns(pointer)) [[unlikely]] {
+        void* result = malloc(size);
+        if (result != nullptr) {
+            std::memcpy(result, pointer,
+                        std::min(size, bootstrap::sizeOf(pointer)));
+        }
+        return result;
+    }
+
+    auto* next = detail::nextRealloc.get();
+    if (next == nullptr) [[unlikely]] {
+        return pointer == nullptr
+                   ? bootstrap::allocate(size, alignof(std::max_align_t))
+                   : nullptr;
+    }
+    return next(pointer, size);
+}
+
+// Falls back to realloc while resolving symbols, or when the C library has no
+// reallocarray.
+inline void* reallocarray(void* pointer, std::size_t n, std::size_t size) {
+    auto* next = detail::nextReallocarray.get();
+    if (next == nullptr || bootstrap::owns(pointer)) [[unlikely]] {
+        std::size_t bytes = 0;
+        if (__builtin_mul_overflow(n, size, &bytes)) {
+            errno = ENOMEM;
+            return nullptr;
+        }
+        return realloc(pointer, bytes);
+    }
+    return next(pointer, n, size);
+}
+
+inline int posix_memalign(void** memptr, std::size_t alignment,
+                          std::size_t size) {
+    auto* next = detail::nextPosixMemalign.get();
+    if (next == nullptr) [[unlikely]] {
+        void* result = bootstrap::allocate(size, alignment);
+        if (result == nullptr) {
+            return ENOMEM;
+        }
+        *memptr = result;
+        return 0;
+    }
+    return next(memptr, alignment, size);
+}
+
+inline void* aligned_alloc(std::size_t alignment, std::size_t size) {
+    auto* next = detail::nextAlignedAlloc.get();
+    if (next == nullptr && detail::resolving) [[unlikely]] {
+        return bootstrap::allocate(size, alignment);
+    }
+    if (next == nullptr) [[unlikely]] {
+        // The C library has no aligned_alloc.
+        void* result = nullptr;
+        const int error = posix_memalign(
+            &result, std::max(alignment, sizeof(void*)), size);
+        if (error != 0) {
+            errno = error;
+            return nullptr;
+        }
+        return result;
+    }
+    return next(alignment, size);
+}
+#endif
+} // namespace real
+} // namespace interpose
+
 #endif // INTERPOSE_H
@@ -0,0 +1,299 @@
+#ifndef INTERPOSE_NEW_H
+#define INTERPOSE_NEW_H
+
+#include <algorithm>
+#include <cstddef>
+#include <new>
+
+#include <interpose.h>
+
+// Replaces every C++ allocation function (plain, array, aligned, nothrow and
+// sized variants) with one forwarding to the next definition, usually the C++
+// runtime's, around two hooks which the including tool defines:
+//
+//   void interpose::onNew(std::size_t size, void* result, void* frame);
+//   void interpose::onDelete(void* pointer, std::size_t size, void* frame);
+//
+// size is 0 in onDelete unless a sized operator was called. frame is the frame
+// of the replaced operator, as given by __builtin_frame_address(0). The
+// runtime's operators are usually built on the malloc family: while they run,
+// interpose::insideOperator() is true, and the tool's malloc family
+// interposers should not record anything.
+//
+// Include this header from exactly one translation unit per tool. On macOS,
+// operators replaced from an inserted library only affect flat namespace
+// images.
+
+static_assert(sizeof(std::size_t) == sizeof(unsigned long),
+              "Mangled operator names assume std::size_t is unsigned long.");
+
+namespace interpose {
+void onNew(std::size_t size, void* result, void* frame);
+void onDelete(void* pointer, std::size_t size, void* frame);
+
+inline thread_local unsigned operatorDepth = 0;
+
+inline bool insideOperator() {
+    return operatorDepth != 0;
+}
+
+namespace detail {
+struct OperatorScope {
+    OperatorScope() {
+        ++operatorDepth;
+    }
+    ~OperatorScope() {
+        --operatorDepth;
+    }
+
+    OperatorScope(const OperatorScope&) = delete;
+    OperatorScope& operator=(const OperatorScope&) = delete;
+    OperatorScope(OperatorScope&&) = delete;
+    OperatorScope& operator=(OperatorScope&&) = delete;
+};
+
+// The replaced operators. They are optional, as C programs may not load the
+// C++ runtime, and are resolved eagerly, along with the malloc family.
+inline constinit Symbol<void*(std::size_t)> nextNew{"_Znwm", true};
+inline constinit Symbol<void*(std::size_t)> nextNewArray{"_Znam", true};
+inline constinit Symbol<void*(std::size_t, std::align_val_t)>
+    nextNewAligned{"_ZnwmSt11align_val_t", true};
+inline constinit Symbol<void*(std::size_t, std::align_val_t)>
+    nextNewArrayAligned{"_ZnamSt11align_val_t", true};
+inline constinit Symbol<void*(std::size_t, const std::nothrow_t&)>
+    nextNewNothrow{"_ZnwmRKSt9nothrow_t", true};
+inline constinit Symbol<void*(std::size_t, const std::nothrow_t&)>
+    nextNewArrayNothrow{"_ZnamRKSt9nothrow_t", true};
+inline constinit Symbol<void*(std::size_t, std::align_val_t,
+                              const std::nothrow_t&)>
+    nextNewAlignedNothrow{"_ZnwmSt11align_val_tRKSt9nothrow_t", true};
+inline constinit Symbol<void*(std::size_t, std::align_val_t,
+                              const std::nothrow_t&)>
+    nextNewArrayAlignedNothrow{"_ZnamSt11align_val_tRKSt9nothrow_t", true};
+inline constinit Symbol<void(void*)> nextDelete{"_ZdlPv", true};
+inline constinit Symbol<void(void*)> nextDeleteArray{"_ZdaPv", true};
+inline constinit Symbol<void(void*, std::size_t)>
+    nextDeleteSized{"_ZdlPvm", true};
+inline constinit Symbol<void(void*, std::size_t)>
+    nextDeleteArraySized{"_ZdaPvm", true};
+inline constinit Symbol<void(void*, std::align_val_t)>
+    nextDeleteAligned{"_ZdlPvSt11align_val_t", true};
+inline constinit Symbol<void(void*, std::align_val_t)>
+    nextDeleteArrayAligned{"_ZdaPvSt11align_val_t", true};
+inline constinit Symbol<void(void*, std::size_t, std::align_val_t)>
+    nextDeleteSizedAligned{"_ZdlPvmSt11align_val_t", true};
+inline constinit Symbol<void(void*, std::size_t, std::align_val_t)>
+    nextDeleteArraySizedAligned{"_ZdaPvmSt11align_val_t", true};
+inline constinit Symbol<void(void*, const std::nothrow_t&)>
+    nextDeleteNothrow{"_ZdlPvRKSt9nothrow_t", true};
+inline constinit Symbol<void(void*, const std::nothrow_t&)>
+    nextDeleteArrayNothrow{"_ZdaPvRKSt9nothrow_t", true};
+inline constinit Symbol<void(void*, std::align_val_t, const std::nothrow_t&)>
+    nextDeleteAlignedNothrow{"_ZdlPvSt11align_val_tRKSt9nothrow_t", true};
+inline constinit Symbol<void(void*, std::align_val_t, const std::nothrow_t&)>
+    nextDeleteArrayAlignedNothrow{"_ZdaPvSt11align_val_tRKSt9nothrow_t", true};
+
+__attribute__((constructor(101))) static void resolveOperatorsEagerly() {
+    nextNew.get();
+    nextNewArray.get();
+    nextNewAligned.get();
+    nextNewArrayAligned.get();
+    nextNewNothrow.get();
+    nextNewArrayNothrow.get();
+    nextNewAlignedNothrow.get();
+    nextNewArrayAlignedNothrow.get();
+    nextDelete.get();
+    nextDeleteArray.get();
+    nextDeleteSized.get();
+    nextDeleteArraySized.get();
+    nextDeleteAligned.get();
+    nextDeleteArrayAligned.get();
+    nextDeleteSizedAligned.get();
+    nextDeleteArraySizedAligned.get();
+    nextDeleteNothrow.get();
+    nextDeleteArrayNothrow.get();
+    nextDeleteAlignedNothrow.get();
+    nextDeleteArrayAlignedNothrow.get();
+}
+
+// While this thread is resolving symbols, or without a C++ runtime, operators
+// are served by the malloc family, whose memory the runtime's operators
+// release with free.
+inline void* newFallback(std::size_t size) {
+    return real::malloc(size);
+}
+
+inline void* newFallback(std::size_t size, std::align_val_t alignment) {
+    void* result = nullptr;
+    const auto bytes
+        = std::max(static_cast<std::size_t>(alignment), sizeof(void*));
+    if (real::posix_memalign(&result, bytes, size) != 0) {
+        return nullptr;
+    }
+    return result;
+}
+
+inline void* newFallback(std::size_t size, const std::nothrow_t& /*tag*/) {
+    return newFallback(size);
+}
+
+inline void* newFallback(std::size_t size, std::align_val_t alignment,
+                         const std::nothrow_t& /*tag*/) {
+    return newFallback(size, alignment);
+}
+
+// Operators nested in another one (array operators calling the plain ones,
+// for instance) are forwarded without being recorded.
+template <typename Function, typename... Args>
+void* callNew(Symbol<Function>& next, void* frame, std::size_t size,
+              const Args&... args) {
+    const bool outermost = !insideOperator();
+    void* result = nullptr;
+    {
+        const OperatorScope scope;
+        auto* real = next.get();
+        result = real != nullptr ? real(size, args...)
+                                 : newFallback(size, args...);
+    }
+    if (outermost) {
+        onNew(size, result, frame);
+    }
+    return result;
+}
+
+template <typename Function, typename... Args>
+void callDelete(Symbol<Function>& next, void* frame, std::size_t size,
+                void* pointer, const Args&... args) {
+    if (!insideOperator()) {
+        onDelete(pointer, size, frame);
+    }
+    const OperatorScope scope;
+    auto* real = next.get();
+    if (real != nullptr) [[likely]] {
+        real(pointer, args...);
+    } else {
+        real::free(pointer);
+    }
+}
+} // namespace detail
+} // namespace interpose
+
+void* operator new(std::size_t size) {
+    return interpose::detail::callNew(interpose::detail::nextNew,
+                                      __builtin_frame_address(0), size);
+}
+
+void* operator new[](std::size_t size) {
+    return interpose::detail::callNew(interpose::detail::nextNewArray,
+                                      __builtin_frame_address(0), size);
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment) {
+    return interpose::detail::callNew(interpose::detail::nextNewAligned,
+                                      __builtin_frame_address(0), size,
+                                      alignment);
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment) {
+    return interpose::detail::callNew(interpose::detail::nextNewArrayAligned,
+                                      __builtin_frame_address(0), size,
+                                      alignment);
+}
+
+void* operator new(std::size_t size, const std::nothrow_t& tag) noexcept {
+    return interpose::detail::callNew(interpose::detail::nextNewNothrow,
+                                      __builtin_frame_address(0), size, tag);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t& tag) noexcept {
+    return interpose::detail::callNew(interpose::detail::nextNewArrayNothrow,
+                                      __builtin_frame_address(0), size, tag);
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment,
+                   const std::nothrow_t& tag) noexcept {
+    return interpose::detail::callNew(interpose::detail::nextNewAlignedNothrow,
+                                      __builtin_frame_address(0), size,
+                                      alignment, tag);
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment,
+                     const std::nothrow_t& tag) noexcept {
+    return interpose::detail::callNew(
+        interpose::detail::nextNewArrayAlignedNothrow,
+        __builtin_frame_address(0), size, alignment, tag);
+}
+
+void operator delete(void* pointer) noexcept {
+    interpose::detail::callDelete(interpose::detail::nextDelete,
+                                  __builtin_frame_address(0), 0, pointer);
+}
+
+void operator delete[](void* pointer) noexcept {
+    interpose::detail::callDelete(interpose::detail::nextDeleteArray,
+                                  __builtin_frame_address(0), 0, pointer);
+}
+
+void operator delete(void* pointer, std::size_t size) noexcept {
+    interpose::detail::callDelete(interpose::detail::nextDeleteSized,
+                                  __builtin_frame_address(0), size, pointer,
+                                  size);
+}
+
+void operator delete[](void* pointer, std::size_t size) noexcept {
+    interpose::detail::callDelete(interpose::detail::nextDeleteArraySized,
+                                  __builtin_frame_address(0), size, pointer,
+                                  size);
+}
+
+void operator delete(void* pointer, std::align_val_t alignment) noexcept {
+    interpose::detail::callDelete(interpose::detail::nextDeleteAligned,
+                                  __builtin_frame_address(0), 0, pointer,
+                                  alignment);
+}
+
+void operator delete[](void* pointer, std::align_val_t alignment) noexcept {
+    interpose::detail::callDelete(interpose::detail::nextDeleteArrayAligned,
+                                  __builtin_frame_address(0), 0, pointer,
+                                  alignment);
+}
+
+void operator delete(void* pointer, std::size_t size,
+                     std::align_val_t alignment) noexcept {
+    interpose::detail::callDelete(interpose::detail::nextDeleteSizedAligned,
+                                  __builtin_frame_address(0), size, pointer,
+                                  size, alignment);
+}
+
+void operator delete[](void* pointer, std::size_t size,
+                       std::align_val_t alignment) noexcept {
+    interpose::detail::callDelete(
+        interpose::detail::nextDeleteArraySizedAligned,
+        __builtin_frame_address(0), size, pointer, size, alignment);
+}
+
+void operator delete(void* pointer, const std::nothrow_t& tag) noexcept {
+    interpose::detail::callDelete(interpose::detail::nextDeleteNothrow,
+                                  __builtin_frame_address(0), 0, pointer, tag);
+}
+
+void operator delete[](void* pointer, const std::nothrow_t& tag) noexcept {
+    interpose::detail::callDelete(interpose::detail::nextDeleteArrayNothrow,
+                                  __builtin_frame_address(0), 0, pointer, tag);
+}
+
+void operator delete(void* pointer, std::align_val_t alignment,
+                     const std::nothrow_t& tag) noexcept {
+    interpose::detail::callDelete(interpose::detail::nextDeleteAlignedNothrow,
+                                  __builtin_frame_address(0), 0, pointer,
+                                  alignment, tag);
+}
+
+void operator delete[](void* pointer, std::align_val_t alignment,
+                       const std::nothrow_t& tag) noexcept {
+    interpose::detail::callDelete(
+        interpose::detail::nextDeleteArrayAlignedNothrow,
+        __builtin_frame_address(0), 0, pointer, alignment, tag);
+}
+
+#endif // INTERPOSE_NEW_H
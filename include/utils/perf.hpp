@@ -1,7 +1,10 @@
 #ifndef UTILS_PERF_HPP
 #define UTILS_PERF_HPP
 
+#include <array>
+#include <cstddef>
 #include <cstdint>
+#include <span>
 #include <string>
 #include <utility>
 #include <vector>
@@ -10,8 +13,34 @@ namespace utils::perf {
 std::string toString(std::uint32_t type, std::uint64_t config);
 std::string toString(std::pair<std::uint32_t, std::uint64_t> event);
 
+// A count, and how long its event was enabled and actually counting. When there
+// are more events than hardware counters, the kernel multiplexes them, and
+// events only count part of the time they are enabled.
+struct Count {
+    std::uint64_t value = 0;
+    std::uint64_t timeEnabled = 0;
+    std::uint64_t timeRunning = 0;
+
+    // The fraction of the time the event was counting: 1 unless multiplexed.
+    [[nodiscard]] double runningRatio() const;
+    // The value extrapolated to the whole time the event was enabled.
+    [[nodiscard]] std::uint64_t scaled() const;
+};
+
+// The most events read by Group::readValues() into fixed storage, as many as
+// there are counters on common cores.
+constexpr std::size_t kMaxFastEvents = 8;
+
+// Events counted together, on the calling thread.
+//
+// With inherit, threads created afterwards are counted too, their counts being
+// added when they exit. Counters are then read one by one, and only while the
+// group is disabled. Without, they are read all at once, with a single system
+// call, even while the group is enabled.
 struct Group {
-    Group(const std::vector<std::pair<std::uint32_t, std::uint64_t>>& events);
+    explicit Group(
+        const std::vector<std::pair<std::uint32_t, std::uint64_t>>& events,
+        bool inherit = true);
     ~Group();
 
     Group(const Group&) = delete;
@@ -25,13 +54,85 @@ struct Group {
     void reset();
 
     [[nodiscard]] bool isEnabled() const;
+    [[nodiscard]] bool inherits() const;
+    [[nodiscard]] std::size_t size() const;
 
+    [[nodiscard]] std::vector<Count> readCounts() const;
+    // Scaled values of readCounts().
     [[nodiscard]] std::vector<std::uint64_t> read() const;
 
+    // Raw values, one per event. Without inherit, counters are read from user
+    // space with rdpmc when the kernel allows it, in tens of nanoseconds rather
+    // than microseconds, falling back to a system call otherwise. Must be
+    // called from the thread which created the group.
+    void readValues(std::span<std::uint64_t> values) const;
+
   private:
+    [[nodiscard]] bool readUserSpace(std::span<std::uint64_t> values) const;
+
     std::vector<int> descriptors;
+    // The perf_event_mmap_page of each event, without inherit, if mapped.
+    std::vector<void*> pages;
+    bool inherit;
     bool enabled = false;
 };
+
+// Counts accumulated over every pass through named regions of code:
+//
+//     utils::perf::Regions regions(group);
+//     const auto phase = regions.add("phase");
+//     ...
+//     {
+//         const auto scope = regions.measure(phase);
+//         ...
+//     }
+//
+// Counts are raw, regions being assumed too short to be multiplexed, and are
+// read with Group::readValues(), so the group must not inherit, nor have more
+// than kMaxFastEvents events, and regions must be measured on the thread which
+// created it.
+class Regions {
+  public:
+    struct Region {
+        std::string name;
+        std::uint64_t entries = 0;
+        std::vector<std::uint64_t> totals;
+    };
+
+    // Adds the counts of its lifetime to its region.
+    class Scope {
+      public:
+        ~Scope();
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+        Scope(Scope&&) = delete;
+        Scope& operator=(Scope&&) = delete;
+
+      private:
+        friend class Regions;
+
+        Scope(Regions& regions, std::size_t region);
+
+        Regions& regions;
+        std::size_t region;
+        std::array<std::uint64_t, kMaxFastEvents> start{};
+    };
+
+    explicit Regions(const Group& group);
+
+    // Returns the identifier to measure the region with.
+    std::size_t add(std::string name);
+
+    [[nodiscard]] Scope measure(std::size_t region);
+
+    [[nodiscard]] const std::vector<Region>& get() const;
+
+  private:
+    const Group& group;
+    std::vector<Region> regions;
+};
 } // namespace utils::perf
 
 #endif
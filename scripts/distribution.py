@@ -10,9 +10,7 @@ def main(args: argparse.Namespace) -> None:
     with open(args.path, "r") as f:
         data = json.load(f)
 
-    # Only work with these size classes; if we add other modes this will need updating.
-    assert data["sizeClasses"] == list(range(1, 4097))
-
+    size_classes = np.array(data["sizeClasses"])
     bins = np.array(data["bins"])
     ignored = data["ignored"]
     print(
@@ -58,11 +56,10 @@ def main(args: argparse.Namespace) -> None:
             4096,
         ]
 
-        # Each bin covers (bin_edges[i-1], bin_edges[i]], first bin covers [1, bin_edges[0]]
-        consolidated = []
-        for i, edge in enumerate(bin_edges):
-            lo = bin_edges[i - 1] if i > 0 else 0
-            consolidated.append(bins[lo:edge].sum())
+        # Each bin covers (bin_edges[i-1], bin_edges[i]], first bin covers [1, bin_edges[0]].
+        # Size classes above the last edge are not plotted.
+        edge_indices = np.searchsorted(bin_edges, size_classes)
+        consolidated = [bins[edge_indices == i].sum() for i in range(len(bin_edges))]
 
         bar_positions = list(range(len(consolidated)))
         ax.bar(
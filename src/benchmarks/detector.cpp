@@ -0,0 +1,44 @@
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+// Measures the cost of a malloc/free pair. Run it once as is, and once with
+// LD_PRELOAD set to a detector library, the difference being the per-call
+// overhead of the detector.
+
+namespace {
+const std::size_t kNumberSizes = 1 << 16;
+
+std::vector<std::size_t> randomSizes(std::size_t maxSize) {
+    auto generator = std::mt19937_64(0);
+    std::uniform_int_distribution<std::size_t> distribution(1, maxSize);
+    std::vector<std::size_t> sizes(kNumberSizes);
+    for (auto& size : sizes) {
+        size = distribution(generator);
+    }
+    return sizes;
+}
+
+void mallocFree(benchmark::State& state) {
+    const auto sizes = randomSizes(state.range(0));
+    std::size_t i = 0;
+    for (auto _ : state) {
+        void* pointer = std::malloc(sizes[i++ % kNumberSizes]);
+        benchmark::DoNotOptimize(pointer);
+        std::free(pointer);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(mallocFree)
+    ->Arg(64)
+    ->Arg(4096)
+    ->Arg(std::int64_t(1) << 20)
+    ->ThreadRange(1, 16);
+} // namespace
+
+BENCHMARK_MAIN();
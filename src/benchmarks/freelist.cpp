@@ -1,63 +1,553 @@
+#ifdef __linux__
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
 #include <chrono>
+#include <condition_variable>
+#include <cstddef>
 #include <cstdint>
 #include <cstdlib>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <ios>
 #include <iostream>
+#include <iterator>
+#include <memory>
+#include <mutex>
 #include <random>
+#include <span>
+#include <string>
 #include <vector>
 
 #include <argparse/argparse.hpp>
+#include <benchmark/benchmark.h>
+
+#include "binary.hpp"
+#include "json.hpp"
 
 namespace {
-void* freelist = nullptr;
+// Freelists are segregated by size class, making a simple segregated-fit pool
+// when sizes are drawn from a distribution.
+enum class Mode : std::uint8_t {
+    // Intrusive freelists local to each thread, returning objects to malloc
+    // beyond a limit.
+    Freelist,
+    // Lock-free freelists shared by all threads.
+    SharedFreelist,
+    // malloc/free, from whichever allocator is preloaded.
+    Malloc,
+};
+
+enum class Pattern : std::uint8_t {
+    // Each thread frees the objects it allocated.
+    Local,
+    // Threads are paired, and one frees the objects the other allocates.
+    ProducerConsumer,
+};
+
+// A Treiber stack. The top holds a pointer in its low 48 bits and a tag, bumped
+// on every push, in its high 16 bits, so that a pop that read a stale top fails
+// even if the same object has been pushed back since (ABA). Objects are not
+// returned to malloc until the benchmark is over, so reading the next pointer
+// of a stale top is safe.
+class SharedFreelist {
+  public:
+    void push(void* ptr) {
+        auto top = head.load(std::memory_order_relaxed);
+        do {
+            next(ptr).store(pointer(top), std::memory_order_relaxed);
+        } while (!head.compare_exchange_weak(top, tagged(ptr, tag(top) + 1),
+                                             std::memory_order_release,
+                                             std::memory_order_relaxed));
+    }
+
+    void* pop() {
+        auto top = head.load(std::memory_order_acquire);
+        while (pointer(top) != nullptr) {
+            void* second = next(pointer(top)).load(std::memory_order_relaxed);
+            if (head.compare_exchange_weak(top, tagged(second, tag(top)),
+                                           std::memory_order_acquire,
+                                           std::memory_order_acquire)) {
+                return pointer(top);
+            }
+        }
+        return nullptr;
+    }
+
+    // Takes the whole stack at once, which is safe to free.
+    void* popAll() {
+        return pointer(head.exchange(0, std::memory_order_acquire));
+    }
+
+  private:
+    static_assert(sizeof(void*) == sizeof(std::uint64_t),
+                  "tagged pointers need 64-bit addresses");
+    static constexpr int kTagShift = 48;
+    static constexpr std::uint64_t kPointerMask
+        = (std::uint64_t(1) << kTagShift) - 1;
+
+    static std::atomic_ref<void*> next(void* ptr) {
+        return std::atomic_ref<void*>(*static_cast<void**>(ptr));
+    }
+
+    static void* pointer(std::uint64_t top) {
+        return reinterpret_cast<void*>( // NOLINT(performance-no-int-to-ptr)
+            top & kPointerMask);
+    }
+
+    static std::uint64_t tag(std::uint64_t top) { return top >> kTagShift; }
 
-void* do_malloc(std::size_t size, bool useMallocFree) {
-    if (useMallocFree || freelist == nullptr) {
+    static std::uint64_t tagged(void* ptr, std::uint64_t tag) {
+        return reinterpret_cast<std::uintptr_t>(ptr) | (tag << kTagShift);
+    }
+
+    std::atomic_uint64_t head = 0;
+};
+
+struct Freelist {
+    void* head = nullptr;
+    std::uint64_t length = 0;
+};
+
+// Indexed by size class.
+thread_local std::vector<Freelist> freelists;
+std::vector<SharedFreelist> sharedFreelists;
+std::uint64_t freelistLimit = 0;
+
+struct Object {
+    void* ptr;
+    std::uint32_t sizeClass;
+};
+
+void* do_malloc(std::size_t size, std::size_t sizeClass, Mode mode) {
+    if (mode == Mode::SharedFreelist) {
+        void* ptr = sharedFreelists[sizeClass].pop();
+        return ptr != nullptr ? ptr : malloc(size);
+    }
+    auto& freelist = freelists[sizeClass];
+    if (mode == Mode::Malloc || freelist.head == nullptr) {
         return malloc(size);
     }
 
-    void* ptr = freelist;
-    freelist = *static_cast<void**>(freelist);
+    void* ptr = freelist.head;
+    freelist.head = *static_cast<void**>(freelist.head);
+    --freelist.length;
     return ptr;
 }
 
-void do_free(void* ptr, bool useMallocFree) {
-    if (useMallocFree) {
+void do_free(void* ptr, std::size_t sizeClass, Mode mode) {
+    if (mode == Mode::SharedFreelist) {
+        sharedFreelists[sizeClass].push(ptr);
+        return;
+    }
+    auto& freelist = freelists[sizeClass];
+    if (mode == Mode::Malloc || freelist.length >= freelistLimit) {
         free(ptr);
         return;
     }
 
-    *static_cast<void**>(ptr) = freelist;
-    freelist = ptr;
+    *static_cast<void**>(ptr) = freelist.head;
+    freelist.head = ptr;
+    ++freelist.length;
+}
+
+void releaseList(void* ptr) {
+    while (ptr != nullptr) {
+        void* next = *static_cast<void**>(ptr);
+        free(ptr);
+        ptr = next;
+    }
+}
+
+void releaseFreelists() {
+    for (auto& freelist : freelists) {
+        releaseList(freelist.head);
+        freelist = {};
+    }
+    for (auto& sharedFreelist : sharedFreelists) {
+        releaseList(sharedFreelist.popAll());
+    }
+}
+
+// Log-linear latency histogram, 8 buckets per power of two. It has a fixed
+// size, so that recording latencies does not allocate from the allocator
+// under test, nor grow the resident set measured after the benchmark.
+class Histogram {
+  public:
+    void record(std::uint64_t ns) {
+        ++counts[bucketOf(ns)];
+        ++total;
+    }
+
+    // Upper bound of the bucket holding the given quantile.
+    [[nodiscard]] std::uint64_t quantile(double q) const {
+        const auto target = static_cast<std::uint64_t>(
+            q * static_cast<double>(total - 1));
+        std::uint64_t seen = 0;
+        for (std::size_t i = 0; i < counts.size(); ++i) {
+            seen += counts[i];
+            if (seen > target) {
+                return upperBoundOf(i);
+            }
+        }
+        return upperBoundOf(counts.size() - 1);
+    }
+
+  private:
+    static constexpr int kSubBucketBits = 3;
+    static constexpr std::uint64_t kSubBuckets = 1 << kSubBucketBits;
+
+    static std::size_t bucketOf(std::uint64_t ns) {
+        if (ns < kSubBuckets) {
+            return ns;
+        }
+        const auto exponent = std::bit_width(ns) - 1;
+        const auto subBucket
+            = (ns >> (exponent - kSubBucketBits)) & (kSubBuckets - 1);
+        return ((exponent - kSubBucketBits + 1) << kSubBucketBits) + subBucket;
+    }
+
+    static std::uint64_t upperBoundOf(std::size_t bucket) {
+        if (bucket < kSubBuckets) {
+            return bucket;
+        }
+        const auto shift = (bucket >> kSubBucketBits) - 1;
+        const auto lower = (kSubBuckets + (bucket & (kSubBuckets - 1)))
+                           << shift;
+        return lower + (std::uint64_t(1) << shift) - 1;
+    }
+
+    std::array<std::uint64_t, (64 - kSubBucketBits + 1) << kSubBucketBits>
+        counts{};
+    std::uint64_t total = 0;
+};
+
+// The resident set size of the process, or 0 if unknown.
+std::uint64_t residentBytes() {
+#ifdef __linux__
+    std::ifstream statm("/proc/self/statm");
+    std::uint64_t size = 0;
+    std::uint64_t resident = 0;
+    if (statm >> size >> resident) {
+        return resident * static_cast<std::uint64_t>(sysconf(_SC_PAGESIZE));
+    }
+#endif
+    return 0;
+}
+
+// Sizes allocated by a benchmark: either one size, or the size classes of a
+// distribution, weighted by their number of allocations.
+struct Sizes {
+    std::string name;
+    std::vector<std::uint64_t> sizeClasses;
+    std::vector<std::uint64_t> weights;
+};
+
+// Reads a distribution generated by the detector, in either format.
+Sizes loadDistribution(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        std::cerr << "Failed to open " << path << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+    // Kept in 8-byte words, as the binary format needs them aligned.
+    const std::string contents((std::istreambuf_iterator<char>(file)),
+                               std::istreambuf_iterator<char>());
+    std::vector<std::uint64_t> words(
+        (contents.size() + sizeof(std::uint64_t) - 1) / sizeof(std::uint64_t));
+    std::copy(contents.begin(), contents.end(),
+              reinterpret_cast<char*>(words.data()));
+    const std::span<const char> data(
+        reinterpret_cast<const char*>(words.data()), contents.size());
+
+    Sizes sizes{"distribution", {}, {}};
+    try {
+        if (distribution::binary::isBinary(data)) {
+            std::string error;
+            const auto view = distribution::binary::View::parse(data, error);
+            if (!view) {
+                std::cerr << path << ": " << error << std::endl;
+                std::exit(EXIT_FAILURE);
+            }
+            sizes.sizeClasses.assign(view->sizeClasses().begin(),
+                                     view->sizeClasses().end());
+            sizes.weights.assign(view->bins().begin(), view->bins().end());
+        } else {
+            const auto json = nlohmann::json::parse(contents);
+            sizes.sizeClasses
+                = json["sizeClasses"].get<std::vector<std::uint64_t>>();
+            sizes.weights = json["bins"].get<std::vector<std::uint64_t>>();
+        }
+    } catch (const std::exception& err) {
+        std::cerr << path << ": " << err.what() << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+
+    if (sizes.sizeClasses.size() != sizes.weights.size()
+        || std::ranges::all_of(sizes.weights,
+                               [](std::uint64_t n) { return n == 0; })) {
+        std::cerr << path << ": no allocations to draw sizes from."
+                  << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+    // Objects must hold a freelist pointer.
+    for (auto& size : sizes.sizeClasses) {
+        size = std::max<std::uint64_t>(size, sizeof(void*));
+    }
+    return sizes;
+}
+
+// Objects passed from a producer to its consumer, in a bounded ring.
+class Channel {
+  public:
+    explicit Channel(std::size_t capacity) : ring(capacity) {}
+
+    // Blocks until there is room for all objects.
+    void push(std::span<const Object> objects) {
+        std::unique_lock lock(mutex);
+        notFull.wait(lock,
+                     [&] { return ring.size() - count >= objects.size(); });
+        for (const auto& object : objects) {
+            ring[(first + count) % ring.size()] = object;
+            ++count;
+        }
+        notEmpty.notify_one();
+    }
+
+    // Blocks until objects.size() objects are available.
+    void pop(std::span<Object> objects) {
+        std::unique_lock lock(mutex);
+        notEmpty.wait(lock, [&] { return count >= objects.size(); });
+        for (auto& object : objects) {
+            object = ring[first];
+            first = (first + 1) % ring.size();
+            --count;
+        }
+        notFull.notify_one();
+    }
+
+  private:
+    std::mutex mutex;
+    std::condition_variable notFull;
+    std::condition_variable notEmpty;
+    std::vector<Object> ring;
+    std::size_t first = 0;
+    std::size_t count = 0;
+};
+
+// Batches of objects a producer may be ahead of its consumer.
+constexpr std::size_t kChannelBatches = 16;
+
+// Sizes are drawn before running, and then used in a loop.
+constexpr std::size_t kNumberSizes = 1 << 16;
+
+struct Configuration {
+    Mode mode;
+    Pattern pattern;
+    std::shared_ptr<const Sizes> sizes;
+    std::uint64_t preseed;
+    std::uint64_t ops;
+    int nThreads;
+
+    [[nodiscard]] std::string name() const {
+        std::string name = "freelist/";
+        switch (mode) {
+            case Mode::Freelist:
+                name += "freelist";
+                break;
+            case Mode::SharedFreelist:
+                name += "shared-freelist";
+                break;
+            case Mode::Malloc:
+                name += "malloc";
+                break;
+        }
+        name += pattern == Pattern::Local ? "/local" : "/producer-consumer";
+        return name + "/size:" + sizes->name
+               + "/preseed:" + std::to_string(preseed)
+               + "/ops:" + std::to_string(ops);
+    }
+};
+
+// Each thread first allocates preseed objects, which stay live. Then, with the
+// local pattern, each iteration makes ops allocations, then frees ops objects
+// picked at random among the live ones. With the producer-consumer pattern,
+// each iteration of a producer makes ops allocations and hands them to its
+// consumer, whose iteration frees them.
+//
+// Besides throughput and the resident set size at the end of the run, the
+// distribution of the time taken by each iteration
+// (a batch of ops operations) is reported, averaged over threads.
+void benchmarkFreelist(benchmark::State& state,
+                       const Configuration& configuration,
+                       std::deque<Channel>& channels, unsigned int seed) {
+    const auto& sizeClasses = configuration.sizes->sizeClasses;
+    const auto mode = configuration.mode;
+    const auto thread = static_cast<std::size_t>(state.thread_index());
+
+    auto generator = std::mt19937(seed + thread);
+    std::discrete_distribution<std::uint32_t> distribution(
+        configuration.sizes->weights.begin(),
+        configuration.sizes->weights.end());
+    std::vector<std::uint32_t> sizeSequence(kNumberSizes);
+    for (auto& sizeClass : sizeSequence) {
+        sizeClass = distribution(generator);
+    }
+    std::size_t next = 0;
+    const auto allocate = [&] {
+        const auto sizeClass = sizeSequence[next++ % kNumberSizes];
+        return Object{do_malloc(sizeClasses[sizeClass], sizeClass, mode),
+                      sizeClass};
+    };
+
+    freelists.resize(sizeClasses.size());
+    std::vector<Object> live;
+    std::vector<Object> batch(configuration.ops);
+    Histogram latencies;
+
+    live.reserve(configuration.preseed + configuration.ops);
+    for (std::uint64_t i = 0; i < configuration.preseed; ++i) {
+        live.push_back(allocate());
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    for (auto _ : state) {
+        const auto iterationStart = std::chrono::steady_clock::now();
+        if (configuration.pattern == Pattern::Local) {
+            for (std::uint64_t j = 0; j < configuration.ops; ++j) {
+                live.push_back(allocate());
+            }
+            for (std::uint64_t j = 0; j < configuration.ops; ++j) {
+                std::uniform_int_distribution<std::size_t> pick(
+                    0, live.size() - 1);
+                const std::size_t idx = pick(generator);
+                do_free(live[idx].ptr, live[idx].sizeClass, mode);
+                live[idx] = live.back();
+                live.pop_back();
+            }
+        } else if (thread % 2 == 0) {
+            for (auto& object : batch) {
+                object = allocate();
+            }
+            channels[thread / 2].push(batch);
+        } else {
+            channels[thread / 2].pop(batch);
+            for (const auto& object : batch) {
+                do_free(object.ptr, object.sizeClass, mode);
+            }
+        }
+        latencies.record(static_cast<std::uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - iterationStart)
+                .count()));
+    }
+    const auto end = std::chrono::steady_clock::now();
+    // Process-wide, so only one thread reports it.
+    if (thread == 0) {
+        state.counters["rss-bytes"]
+            = static_cast<double>(residentBytes());
+    }
+
+    const auto operations
+        = state.iterations() * configuration.ops
+          * (configuration.pattern == Pattern::Local ? 2 : 1);
+    state.SetItemsProcessed(static_cast<std::int64_t>(operations));
+    state.counters["ns/op"] = benchmark::Counter(
+        std::chrono::duration<double, std::nano>(end - start).count()
+            / static_cast<double>(operations),
+        benchmark::Counter::kAvgThreads);
+
+    for (const auto& [name, quantile] :
+         {std::pair{"p50-batch-ns", 0.5}, std::pair{"p99-batch-ns", 0.99},
+          std::pair{"p99.9-batch-ns", 0.999}}) {
+        state.counters[name] = benchmark::Counter(
+            static_cast<double>(latencies.quantile(quantile)),
+            benchmark::Counter::kAvgThreads);
+    }
+
+    for (const auto& object : live) {
+        free(object.ptr);
+    }
+    releaseFreelists();
 }
 } // namespace
 
+// Benchmarks intrusive freelists against malloc/free, for every combination of
+// the given parameters. Run it with LD_PRELOAD set to compare allocators.
+// Google Benchmark options (--benchmark_filter, --benchmark_format=json,
+// --benchmark_out=FILE, ...) are accepted as well.
 int main(int argc, char** argv) {
-    auto program = argparse::ArgumentParser("benchmark_iterator", "",
+    benchmark::Initialize(&argc, argv);
+
+    auto program = argparse::ArgumentParser("benchmark_freelist", "",
                                             argparse::default_arguments::help);
     program.add_argument("-s", "--allocation-size")
-        .default_value(std::uint64_t(16))
-        .help("the size in bytes of objects")
+        .default_value(std::vector<std::uint64_t>{16})
+        .help("the sizes in bytes of objects")
+        .nargs(argparse::nargs_pattern::at_least_one)
         .metavar("SIZE")
         .scan<'u', std::uint64_t>();
-    program.add_argument("-i", "--iterations")
-        .default_value(std::uint64_t(10'000'000))
-        .help("the number of iterations")
-        .metavar("N")
-        .scan<'u', std::uint64_t>();
-    program.add_argument("--no-freelist")
-        .help("whether to use regular malloc/free over the freelist")
-        .default_value(false)
-        .implicit_value(true);
+    program.add_argument("-d", "--distribution")
+        .help("draw sizes from a distribution generated by the detector, "
+              "instead of using --allocation-size")
+        .metavar("FILE");
+    program.add_argument("-m", "--mode")
+        .help("the allocators to compare: freelist (per thread and size "
+              "class), shared-freelist (lock-free, per size class), malloc")
+        .default_value(std::vector<std::string>{"freelist", "malloc"})
+        .nargs(argparse::nargs_pattern::at_least_one)
+        .metavar("MODE");
+    program.add_argument("--pattern")
+        .help("the allocation patterns: local (threads free their own "
+              "objects), producer-consumer (threads free objects allocated by "
+              "another)")
+        .default_value(std::vector<std::string>{"local"})
+        .nargs(argparse::nargs_pattern::at_least_one)
+        .metavar("PATTERN");
+    program.add_argument("-t", "--threads")
+        .help("the numbers of threads (even for producer-consumer)")
+        .default_value(std::vector<int>{1})
+        .nargs(argparse::nargs_pattern::at_least_one)
+        .metavar("T")
+        .scan<'d', int>();
     program.add_argument("-p", "--preseed")
-        .default_value(std::uint64_t(4096))
-        .help("number of allocations to pre-seed the freelist with")
+        .default_value(std::vector<std::uint64_t>{4096})
+        .help("numbers of allocations to pre-seed the freelist with")
+        .nargs(argparse::nargs_pattern::at_least_one)
         .metavar("N")
         .scan<'u', std::uint64_t>();
     program.add_argument("-o", "--ops")
-        .default_value(std::uint64_t(64))
-        .help("number of allocations or frees per iteration")
+        .default_value(std::vector<std::uint64_t>{64})
+        .help("numbers of allocations, then frees, per iteration")
+        .nargs(argparse::nargs_pattern::at_least_one)
         .metavar("N")
         .scan<'u', std::uint64_t>();
+    program.add_argument("-c", "--cache-limit")
+        .default_value(std::uint64_t(1) << 16)
+        .help("the number of objects a per-thread freelist holds, beyond which "
+              "they are returned to malloc")
+        .metavar("N")
+        .scan<'u', std::uint64_t>();
+    program.add_argument("--seed")
+        .help("initial seed for the random number generator")
+        .default_value(std::random_device()())
+        .scan<'d', unsigned int>();
+    program.add_argument("-r", "--repetitions")
+        .help("the number of times each benchmark is repeated, for statistics")
+        .default_value(5)
+        .metavar("N")
+        .scan<'d', int>();
+    program.add_argument("--warm-up")
+        .help("the minimum time in seconds each benchmark runs before being "
+              "measured")
+        .default_value(0.1)
+        .metavar("SECONDS")
+        .scan<'g', double>();
 
     try {
         program.parse_args(argc, argv);
@@ -67,55 +557,115 @@ int main(int argc, char** argv) {
         std::exit(EXIT_FAILURE);
     }
 
-    const auto allocationSize = program.get<std::uint64_t>("--allocation-size");
-    const auto useMallocFree = program.get<bool>("--no-freelist");
-    const auto iterations = program.get<std::uint64_t>("--iterations");
-    const auto preseed = program.get<std::uint64_t>("--preseed");
-    const auto ops = program.get<std::uint64_t>("--ops");
-
-    std::cout << "Using malloc/free? " << (useMallocFree ? "yes" : "no")
-              << std::endl;
-
-    auto generator = std::mt19937(std::random_device{}());
-    std::vector<void*> live;
+    const auto allocationSizes
+        = program.get<std::vector<std::uint64_t>>("--allocation-size");
+    const auto distribution = program.present("--distribution");
+    const auto modeNames = program.get<std::vector<std::string>>("--mode");
+    const auto patternNames
+        = program.get<std::vector<std::string>>("--pattern");
+    const auto nThreads = program.get<std::vector<int>>("--threads");
+    const auto preseeds = program.get<std::vector<std::uint64_t>>("--preseed");
+    const auto ops = program.get<std::vector<std::uint64_t>>("--ops");
+    const auto seed = program.get<unsigned int>("--seed");
+    const auto repetitions = program.get<int>("--repetitions");
+    const auto warmUp = program.get<double>("--warm-up");
+    freelistLimit = program.get<std::uint64_t>("--cache-limit");
 
-    live.reserve(preseed);
-    for (std::uint64_t i = 0; i < preseed; ++i) {
-        live.push_back(do_malloc(allocationSize, useMallocFree));
+    std::vector<Mode> modes;
+    for (const auto& mode : modeNames) {
+        if (mode == "freelist") {
+            modes.push_back(Mode::Freelist);
+        } else if (mode == "shared-freelist") {
+            modes.push_back(Mode::SharedFreelist);
+        } else if (mode == "malloc") {
+            modes.push_back(Mode::Malloc);
+        } else {
+            std::cerr << "Unknown mode: " << mode << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
     }
-
-    const auto start = std::chrono::high_resolution_clock::now();
-
-    for (std::uint64_t i = 0; i < iterations; ++i) {
-        if (i % 2 == 0) {
-            for (std::uint64_t j = 0; j < ops; ++j) {
-                live.push_back(do_malloc(allocationSize, useMallocFree));
-            }
+    std::vector<Pattern> patterns;
+    for (const auto& pattern : patternNames) {
+        if (pattern == "local") {
+            patterns.push_back(Pattern::Local);
+        } else if (pattern == "producer-consumer") {
+            patterns.push_back(Pattern::ProducerConsumer);
         } else {
-            for (std::uint64_t j = 0; j < ops; ++j) {
-                std::uniform_int_distribution<std::size_t> pick(0, live.size()
-                                                                       - 1);
-                const std::size_t idx = pick(generator);
-                do_free(live[idx], useMallocFree);
-                live[idx] = live.back();
-                live.pop_back();
+            std::cerr << "Unknown pattern: " << pattern << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+    }
+    std::vector<std::shared_ptr<const Sizes>> sizes;
+    if (distribution) {
+        sizes.push_back(
+            std::make_shared<const Sizes>(loadDistribution(*distribution)));
+    } else {
+        for (const auto allocationSize : allocationSizes) {
+            if (allocationSize < sizeof(void*)) {
+                std::cerr << "Allocation size must be at least sizeof(void*) "
+                          << "= " << sizeof(void*) << "." << std::endl;
+                std::exit(EXIT_FAILURE);
             }
+            sizes.push_back(std::make_shared<const Sizes>(
+                Sizes{std::to_string(allocationSize), {allocationSize}, {1}}));
         }
     }
+    std::size_t nSizeClasses = 0;
+    for (const auto& entry : sizes) {
+        nSizeClasses = std::max(nSizeClasses, entry->sizeClasses.size());
+    }
+    sharedFreelists = std::vector<SharedFreelist>(nSizeClasses);
+    if (std::ranges::any_of(nThreads, [](int n) { return n <= 0; })) {
+        std::cerr << "There must be at least one thread." << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
 
-    const auto end = std::chrono::high_resolution_clock::now();
+    std::cout << "seed: " << seed << std::endl;
 
-    for (void* ptr : live) {
-        free(ptr);
+    std::vector<Configuration> configurations;
+    for (const auto mode : modes) {
+        for (const auto pattern : patterns) {
+            for (const auto& entry : sizes) {
+                for (const auto preseed : preseeds) {
+                    for (const auto n : ops) {
+                        for (const auto t : nThreads) {
+                            configurations.push_back(
+                                {mode, pattern, entry, preseed, n, t});
+                        }
+                    }
+                }
+            }
+        }
     }
-    while (freelist != nullptr) {
-        void* next = *static_cast<void**>(freelist);
-        free(freelist);
-        freelist = next;
+
+    for (const auto& configuration : configurations) {
+        if (configuration.pattern == Pattern::ProducerConsumer
+            && configuration.nThreads % 2 != 0) {
+            std::cerr << "Skipping " << configuration.name() << " on "
+                      << configuration.nThreads
+                      << " thread(s): producers and consumers come in pairs."
+                      << std::endl;
+            continue;
+        }
+
+        // Producers push as many batches as their consumers pop, so channels
+        // are empty again after each run.
+        auto channels = std::make_shared<std::deque<Channel>>();
+        for (int i = 0; i < configuration.nThreads / 2; ++i) {
+            channels->emplace_back(kChannelBatches * configuration.ops);
+        }
+        benchmark::RegisterBenchmark(
+            configuration.name().c_str(),
+            [configuration, channels, seed](benchmark::State& state) {
+                benchmarkFreelist(state, configuration, *channels, seed);
+            })
+            ->Threads(configuration.nThreads)
+            ->UseRealTime()
+            ->MinWarmUpTime(warmUp)
+            ->Repetitions(repetitions)
+            ->DisplayAggregatesOnly(repetitions > 1);
     }
 
-    const auto elapsed_ms
-        = std::chrono::duration_cast<std::chrono::milliseconds>(end - start)
-              .count();
-    std::cout << "Done. Time elapsed: " << elapsed_ms << " ms." << std::endl;
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
 }
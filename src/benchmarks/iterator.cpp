@@ -3,7 +3,9 @@
 #endif
 
 #include <algorithm>
+#include <barrier>
 #include <cerrno>
+#include <cstddef>
 #include <chrono>
 #include <cstdint>
 #include <cstdlib>
@@ -13,6 +15,7 @@
 #include <iterator>
 #include <random>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
@@ -25,6 +28,8 @@
 #endif
 
 namespace {
+constexpr std::uint64_t kCacheLineSize = 64;
+
 constexpr std::size_t alignUp(std::size_t size, std::size_t alignment) {
     return (size + alignment - 1) & ~(alignment - 1);
 }
@@ -99,52 +104,321 @@ std::vector<Node*> allocateObjects(const std::string& policy,
     return objects;
 };
 
-void runBenchmark(std::uint64_t iterations, Node* n) {
-    while (--iterations > 0) {
-        n = n->next;
+void releaseObjects(const std::string& policy,
+                    const std::vector<Node*>& objects,
+                    std::size_t allocationSize) {
+    if (policy == "individual-malloc") {
+        for (auto* object : objects) {
+            std::free(object);
+        }
+    } else if (policy == "arena-malloc") {
+        std::free(objects[0]);
+    }
+#ifndef _WIN32
+    else if (policy == "arena-mmap" || policy == "arena-mmap-hugepage") {
+        const auto status = munmap(
+            objects[0], alignUp(objects.size() * allocationSize,
+                                policy == "arena-mmap" ? 4096 : 1 << 21));
+        if (status != 0) {
+            std::cerr << "Failed to free memory..." << std::endl;
+            std::cerr << std::strerror(errno) << std::endl;
+            std::abort();
+        }
+    }
+#endif
+    else {
+        std::abort();
+    }
+}
+
+// Follows all chains in lockstep: their loads do not depend on each other, so
+// up to chains.size() cache misses may be in flight at once.
+void runBenchmark(std::uint64_t accesses, std::vector<Node*>& chains) {
+    for (std::uint64_t i = 0; i < accesses / chains.size(); ++i) {
+        for (auto*& n : chains) {
+            n = n->next;
+        }
+    }
+    benchmark::DoNotOptimize(chains.data());
+    benchmark::ClobberMemory();
+}
+
+struct Configuration {
+    std::string policy;
+    std::uint64_t nObjects;
+    std::uint64_t allocationSize;
+    bool shuffle;
+    std::uint64_t nChains;
+    std::uint64_t nThreads;
+    bool sharedCycle;
+
+    [[nodiscard]] std::uint64_t nStarts() const {
+        return nChains * (sharedCycle ? nThreads : 1);
+    }
+
+    [[nodiscard]] std::string name() const {
+        return "iterator/" + policy + "/objects:" + std::to_string(nObjects)
+               + "/size:" + std::to_string(allocationSize)
+               + (shuffle ? "/shuffled" : "/sequential")
+               + "/chains:" + std::to_string(nChains)
+               + "/threads:" + std::to_string(nThreads)
+               + (sharedCycle ? "/shared" : "");
+    }
+};
+
+std::vector<std::vector<Node*>>
+setUpCycles(const Configuration& configuration, std::mt19937_64& generator) {
+    const auto nCycles = configuration.sharedCycle ? 1 : configuration.nThreads;
+    std::vector<std::vector<Node*>> cycles;
+    for (std::uint64_t cycle = 0; cycle < nCycles; ++cycle) {
+        auto objects
+            = allocateObjects(configuration.policy, configuration.nObjects,
+                              configuration.allocationSize, generator);
+
+        if (configuration.shuffle) {
+            // Keep the first address in place to use it when releasing the
+            // memory.
+            std::shuffle(std::next(objects.begin()), objects.end(), generator);
+        }
+
+        objects.back()->next = objects[0];
+        for (std::size_t i = 0; i < objects.size() - 1; ++i) {
+            objects[i]->next = objects[i + 1];
+        }
+        cycles.push_back(std::move(objects));
+    }
+    return cycles;
+}
+
+// On a shared cycle, the chains of all threads are spread over it.
+std::vector<std::vector<Node*>>
+startChains(const Configuration& configuration,
+            const std::vector<std::vector<Node*>>& cycles) {
+    std::vector<std::vector<Node*>> chains(configuration.nThreads);
+    for (std::uint64_t thread = 0; thread < configuration.nThreads; ++thread) {
+        const auto& objects = cycles[configuration.sharedCycle ? 0 : thread];
+        for (std::uint64_t chain = 0; chain < configuration.nChains; ++chain) {
+            const auto start = configuration.sharedCycle
+                                   ? (thread * configuration.nChains) + chain
+                                   : chain;
+            chains[thread].push_back(
+                objects[start * objects.size() / configuration.nStarts()]);
+        }
+    }
+    return chains;
+}
+
+#ifdef ENABLE_PERF
+struct Event {
+    std::uint32_t type;
+    std::uint64_t config;
+    const char* name;
+};
+
+constexpr std::uint64_t cacheEvent(std::uint64_t cache, std::uint64_t op,
+                                   std::uint64_t result) {
+    return cache | (op << 8) | (result << 16);
+}
+
+// FIXME: Adding the prefetch counters and more precise L1/LLC counters would be
+// nice, but not supported.
+const std::vector<Event> kEvents = {
+    {PERF_TYPE_HW_CACHE,
+     cacheEvent(PERF_COUNT_HW_CACHE_DTLB, PERF_COUNT_HW_CACHE_OP_READ,
+                PERF_COUNT_HW_CACHE_RESULT_MISS),
+     "dTLB-read-misses"},
+    {PERF_TYPE_HW_CACHE,
+     cacheEvent(PERF_COUNT_HW_CACHE_DTLB, PERF_COUNT_HW_CACHE_OP_WRITE,
+                PERF_COUNT_HW_CACHE_RESULT_MISS),
+     "dTLB-write-misses"},
+    {PERF_TYPE_HW_CACHE,
+     cacheEvent(PERF_COUNT_HW_CACHE_DTLB, PERF_COUNT_HW_CACHE_OP_READ,
+                PERF_COUNT_HW_CACHE_RESULT_ACCESS),
+     "dTLB-reads"},
+    {PERF_TYPE_HW_CACHE,
+     cacheEvent(PERF_COUNT_HW_CACHE_DTLB, PERF_COUNT_HW_CACHE_OP_WRITE,
+                PERF_COUNT_HW_CACHE_RESULT_ACCESS),
+     "dTLB-writes"},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, "LLC-misses"},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES, "LLC-references"},
+};
+
+double ratio(std::uint64_t numerator, std::uint64_t denominator) {
+    return denominator == 0 ? 0.0
+                            : static_cast<double>(numerator)
+                                  / static_cast<double>(denominator);
+}
+#endif
+
+// Each iteration accesses as many objects as a cycle holds (rounded down to a
+// multiple of the chains) on every thread. Threads are started once per run,
+// and synchronized with barriers around each iteration, which is timed from
+// the first barrier to the last thread finishing.
+void benchmarkIterator(benchmark::State& state,
+                       const Configuration& configuration, unsigned int seed) {
+    std::mt19937_64 generator(seed);
+    auto cycles = setUpCycles(configuration, generator);
+    auto chains = startChains(configuration, cycles);
+    const auto accesses = configuration.nObjects / configuration.nChains
+                          * configuration.nChains;
+
+#ifdef ENABLE_PERF
+    std::vector<std::pair<std::uint32_t, std::uint64_t>> events;
+    events.reserve(kEvents.size());
+    for (const auto& event : kEvents) {
+        events.emplace_back(event.type, event.config);
+    }
+    // Threads inherit the counters when they are created, and add their counts
+    // to them when they exit, so they must be created after the group.
+    utils::perf::Group group(events);
+#endif
+
+    const auto nThreads = static_cast<std::ptrdiff_t>(configuration.nThreads);
+    std::barrier begin(nThreads);
+    std::barrier end(nThreads);
+    bool stop = false;
+    std::vector<std::thread> workers;
+    workers.reserve(configuration.nThreads - 1);
+    for (std::uint64_t thread = 1; thread < configuration.nThreads; ++thread) {
+        workers.emplace_back([&, thread] {
+            while (true) {
+                begin.arrive_and_wait();
+                if (stop) {
+                    return;
+                }
+                runBenchmark(accesses, chains[thread]);
+                end.arrive_and_wait();
+            }
+        });
+    }
+
+#ifdef ENABLE_PERF
+    group.reset();
+    group.enable();
+#endif
+    std::chrono::duration<double> elapsed{0};
+    for (auto _ : state) {
+        begin.arrive_and_wait();
+        const auto start = std::chrono::steady_clock::now();
+        runBenchmark(accesses, chains[0]);
+        end.arrive_and_wait();
+        const auto iteration = std::chrono::steady_clock::now() - start;
+        state.SetIterationTime(
+            std::chrono::duration<double>(iteration).count());
+        elapsed += iteration;
+    }
+#ifdef ENABLE_PERF
+    group.disable();
+#endif
+
+    stop = true;
+    begin.arrive_and_wait();
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    const auto threadAccesses = state.iterations() * accesses;
+    const auto totalAccesses = threadAccesses * configuration.nThreads;
+    state.SetItemsProcessed(static_cast<std::int64_t>(totalAccesses));
+    // Counting one cache line per access.
+    state.SetBytesProcessed(
+        static_cast<std::int64_t>(totalAccesses * kCacheLineSize));
+    state.counters["ns/access"]
+        = std::chrono::duration<double, std::nano>(elapsed).count()
+          / static_cast<double>(threadAccesses);
+    state.counters["ns/step"]
+        = state.counters["ns/access"]
+          * static_cast<double>(configuration.nChains);
+
+#ifdef ENABLE_PERF
+    // Counts are scaled up if the events were multiplexed, and the fraction of
+    // the time they were counting is reported along.
+    const auto readings = group.readCounts();
+    std::vector<std::uint64_t> counts;
+    for (std::size_t i = 0; i < kEvents.size(); ++i) {
+        counts.push_back(readings[i].scaled());
+        state.counters[std::string(kEvents[i].name) + "/access"]
+            = ratio(counts[i], totalAccesses);
+        state.counters[std::string(kEvents[i].name) + "-running"]
+            = readings[i].runningRatio();
+    }
+    state.counters["dTLB-read-miss-rate"] = ratio(counts[0], counts[2]);
+    state.counters["dTLB-write-miss-rate"] = ratio(counts[1], counts[3]);
+    state.counters["LLC-miss-rate"] = ratio(counts[4], counts[5]);
+#endif
+
+    for (const auto& objects : cycles) {
+        releaseObjects(configuration.policy, objects,
+                       configuration.allocationSize);
     }
-    benchmark::DoNotOptimize(n);
 }
 } // namespace
 
+// Benchmarks iterating over linked objects, for every combination of the given
+// parameters. Google Benchmark options (--benchmark_filter,
+// --benchmark_format=json, --benchmark_out=FILE, ...) are accepted as well.
 int main(int argc, char** argv) {
+    benchmark::Initialize(&argc, argv);
+
     auto program = argparse::ArgumentParser("benchmark_iterator", "",
                                             argparse::default_arguments::help);
     program.add_argument("-n", "--number-objects")
         .required()
-        .help("the number of objects to be allocated")
+        .help("the numbers of objects to be allocated, per cycle")
+        .nargs(argparse::nargs_pattern::at_least_one)
         .metavar("N")
         .scan<'u', std::uint64_t>();
     program.add_argument("-s", "--allocation-size")
-        .default_value(std::uint64_t(4096))
-        .help("the size in bytes of each allocated object (min: sizeof(void*))")
+        .default_value(std::vector<std::uint64_t>{4096})
+        .help("the sizes in bytes of each allocated object (min: "
+              "sizeof(void*))")
+        .nargs(argparse::nargs_pattern::at_least_one)
         .metavar("SIZE")
         .scan<'u', std::uint64_t>();
-    program.add_argument("-i", "--iterations")
-        .required()
-        .help("the number of iterations over the entire allocated population")
-        .metavar("N")
-        .scan<'u', std::uint64_t>();
     program.add_argument("-p", "--allocation-policy")
-        .help("the allocation policy to use")
-        .default_value("individual-malloc")
-#ifdef _WIN32
-        .choices("individual-malloc", "arena-malloc")
-#elif defined(__APPLE__)
-        .choices("individual-malloc", "arena-malloc", "arena-mmap")
-#else
-        .choices("individual-malloc", "arena-malloc", "arena-mmap",
-                 "arena-mmap-hugepage")
-#endif
+        .help("the allocation policies to use: individual-malloc, "
+              "arena-malloc, arena-mmap (not on Windows), arena-mmap-hugepage "
+              "(Linux only)")
+        .default_value(std::vector<std::string>{"individual-malloc"})
+        .nargs(argparse::nargs_pattern::at_least_one)
         .metavar("POLICY");
+    program.add_argument("--order")
+        .help("the orders of the cycle: shuffled, sequential")
+        .default_value(std::vector<std::string>{"shuffled"})
+        .nargs(argparse::nargs_pattern::at_least_one)
+        .metavar("ORDER");
+    program.add_argument("-k", "--chains")
+        .help("the numbers of chains each thread follows at the same time, "
+              "starting from evenly spaced objects of the cycle")
+        .default_value(std::vector<std::uint64_t>{1})
+        .nargs(argparse::nargs_pattern::at_least_one)
+        .metavar("K")
+        .scan<'u', std::uint64_t>();
+    program.add_argument("-t", "--threads")
+        .help("the numbers of threads, each with its own cycle")
+        .default_value(std::vector<std::uint64_t>{1})
+        .nargs(argparse::nargs_pattern::at_least_one)
+        .metavar("T")
+        .scan<'u', std::uint64_t>();
+    program.add_argument("--shared-cycle")
+        .help("have all threads follow the same cycle")
+        .default_value(false)
+        .implicit_value(true);
     program.add_argument("--seed")
         .help("initial seed for the random number generator")
         .default_value(std::random_device()())
         .scan<'d', unsigned int>();
-    program.add_argument("--no-shuffle")
-        .help("disable shuffling the cycle")
-        .default_value(false)
-        .implicit_value(true);
+    program.add_argument("-r", "--repetitions")
+        .help("the number of times each benchmark is repeated, for statistics")
+        .default_value(5)
+        .metavar("N")
+        .scan<'d', int>();
+    program.add_argument("--warm-up")
+        .help("the minimum time in seconds each benchmark runs before being "
+              "measured")
+        .default_value(0.1)
+        .metavar("SECONDS")
+        .scan<'g', double>();
 
     try {
         program.parse_args(argc, argv);
@@ -154,122 +428,93 @@ int main(int argc, char** argv) {
         std::exit(EXIT_FAILURE);
     }
 
-    const auto nObjects = program.get<std::uint64_t>("--number-objects");
-    const auto allocationSize = program.get<std::uint64_t>("--allocation-size");
-    const auto iterations = program.get<std::uint64_t>("--iterations");
-    const auto policy = program.get<std::string>("--allocation-policy");
+    const auto nObjects
+        = program.get<std::vector<std::uint64_t>>("--number-objects");
+    const auto allocationSizes
+        = program.get<std::vector<std::uint64_t>>("--allocation-size");
+    const auto policies
+        = program.get<std::vector<std::string>>("--allocation-policy");
+    const auto orders = program.get<std::vector<std::string>>("--order");
+    const auto nChains = program.get<std::vector<std::uint64_t>>("--chains");
+    const auto nThreads = program.get<std::vector<std::uint64_t>>("--threads");
+    const auto sharedCycle = program.get<bool>("--shared-cycle");
     const auto seed = program.get<unsigned int>("--seed");
-    const auto shuffle = !program.get<bool>("--no-shuffle");
+    const auto repetitions = program.get<int>("--repetitions");
+    const auto warmUp = program.get<double>("--warm-up");
 
-    if (allocationSize < sizeof(Node)) {
-        std::cerr << "Allocation size must be at least sizeof(Node) = "
-                  << sizeof(void*) << "." << std::endl;
-        std::exit(EXIT_FAILURE);
+    for (const auto& policy : policies) {
+        if (policy != "individual-malloc" && policy != "arena-malloc"
+#ifndef _WIN32
+            && policy != "arena-mmap"
+#ifndef __APPLE__
+            && policy != "arena-mmap-hugepage"
+#endif
+#endif
+        ) {
+            std::cerr << "Unsupported allocation policy: " << policy
+                      << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
     }
-
-    std::cout << "policy            : " << policy << std::endl;
-    std::cout << "number of objects : " << nObjects << std::endl;
-    std::cout << "allocation size.  : " << allocationSize << std::endl;
-    std::cout << "iterations        : " << iterations << std::endl;
-    std::cout << "seed              : " << seed << std::endl;
-    std::cout << "shuffle           : " << (shuffle ? "yes" : "no")
-              << std::endl;
-
-    std::mt19937_64 generator(seed);
-    std::cout << "Allocating " << nObjects << " objects of size "
-              << allocationSize << "..." << std::endl;
-    std::vector<Node*> objects
-        = allocateObjects(policy, nObjects, allocationSize, generator);
-
-    if (shuffle) {
-        std::cout << "Shuffling iteration order..." << std::endl;
-        // Keep the first address in place to use it when releasing the memory.
-        std::shuffle(std::next(objects.begin()), objects.end(), generator);
+    for (const auto& order : orders) {
+        if (order != "shuffled" && order != "sequential") {
+            std::cerr << "Unknown order: " << order << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
     }
-
-    std::cout << "Setting up cycle..." << std::endl;
-    objects.back()->next = objects[0];
-    for (std::size_t i = 0; i < nObjects - 1; ++i) {
-        objects[i]->next = objects[i + 1];
+    for (const auto allocationSize : allocationSizes) {
+        if (allocationSize < sizeof(Node)) {
+            std::cerr << "Allocation size must be at least sizeof(Node) = "
+                      << sizeof(void*) << "." << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
     }
-
-    std::cout << "Iterating..." << std::endl;
-
-#ifdef ENABLE_PERF
-    const auto events = std::vector<std::pair<std::uint32_t, std::uint64_t>>(
-        {{PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB
-                                  | (PERF_COUNT_HW_CACHE_OP_READ << 8)
-                                  | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
-         {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB
-                                  | (PERF_COUNT_HW_CACHE_OP_WRITE << 8)
-                                  | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
-         {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB
-                                  | (PERF_COUNT_HW_CACHE_OP_READ << 8)
-                                  | (PERF_COUNT_HW_CACHE_RESULT_ACCESS << 16)},
-         {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB
-                                  | (PERF_COUNT_HW_CACHE_OP_WRITE << 8)
-                                  | (PERF_COUNT_HW_CACHE_RESULT_ACCESS << 16)},
-         {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
-         {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES}});
-    // FIXME: Adding the prefetch counters and more precise L1/LLC counters
-    // would be nice, but not supported.
-    utils::perf::Group group(events);
-    group.reset();
-    group.enable();
-#endif
-    const auto start = std::chrono::high_resolution_clock::now();
-
-    runBenchmark(iterations, objects[0]);
-
-    const auto end = std::chrono::high_resolution_clock::now();
-#ifdef ENABLE_PERF
-    group.disable();
-#endif
-
-    const auto elapsed_ms
-        = std::chrono::duration_cast<std::chrono::milliseconds>(end - start)
-              .count();
-    std::cout << "Done. Time elapsed: " << elapsed_ms << " ms." << std::endl;
-#ifdef ENABLE_PERF
-    const auto counts = group.read();
-    for (std::size_t i = 0; i < events.size(); ++i) {
-        std::cout << utils::perf::toString(events.at(i)) << " = " << counts[i]
+    if (std::ranges::count(nChains, 0) != 0
+        || std::ranges::count(nThreads, 0) != 0) {
+        std::cerr << "There must be at least one chain and one thread."
                   << std::endl;
+        std::exit(EXIT_FAILURE);
     }
-    std::cout << "dTLB read miss rate: "
-              << 100.0 * static_cast<double>(counts[0])
-                     / static_cast<double>(counts[2])
-              << "%" << std::endl;
-    std::cout << "dTLB write miss rate: "
-              << 100.0 * static_cast<double>(counts[1])
-                     / static_cast<double>(counts[3])
-              << "%" << std::endl;
-    std::cout << "LLC miss rate: "
-              << 100.0 * static_cast<double>(counts[4])
-                     / static_cast<double>(counts[5])
-              << "%" << std::endl;
-#endif
 
-    if (policy == "individual-malloc") {
-        for (auto* object : objects) {
-            std::free(object);
+    std::cout << "seed: " << seed << std::endl;
+
+    std::vector<Configuration> configurations;
+    for (const auto& policy : policies) {
+        for (const auto n : nObjects) {
+            for (const auto allocationSize : allocationSizes) {
+                for (const auto& order : orders) {
+                    for (const auto k : nChains) {
+                        for (const auto t : nThreads) {
+                            configurations.push_back(
+                                {policy, n, allocationSize, order == "shuffled",
+                                 k, t, sharedCycle});
+                        }
+                    }
+                }
+            }
         }
-    } else if (policy == "arena-malloc") {
-        std::free(objects[0]);
     }
-#ifndef _WIN32
-    else if (policy == "arena-mmap" || policy == "arena-mmap-hugepage") {
-        const auto status = munmap(
-            objects[0], alignUp(nObjects * allocationSize,
-                                policy == "arena-mmap" ? 4096 : 1 << 21));
-        if (status != 0) {
-            std::cerr << "Failed to free memory..." << std::endl;
-            std::cerr << std::strerror(errno) << std::endl;
-            std::abort();
+
+    for (const auto& configuration : configurations) {
+        if (configuration.nStarts() > configuration.nObjects) {
+            std::cerr << "Skipping " << configuration.name() << ": a cycle of "
+                      << configuration.nObjects << " objects cannot hold "
+                      << configuration.nStarts() << " chains." << std::endl;
+            continue;
         }
+        benchmark::RegisterBenchmark(configuration.name().c_str(),
+                                     [configuration,
+                                      seed](benchmark::State& state) {
+                                         benchmarkIterator(state, configuration,
+                                                           seed);
+                                     })
+            ->UseManualTime()
+            ->Unit(benchmark::kMillisecond)
+            ->MinWarmUpTime(warmUp)
+            ->Repetitions(repetitions)
+            ->DisplayAggregatesOnly(repetitions > 1);
     }
-#endif
-    else {
-        std::abort();
-    }
+
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
 }
@@ -1,36 +1,40 @@
 #include <stdlib.h> // NOLINT(modernize-deprecated-headers)
 
 #include <interpose.h>
+#include <interpose_new.h>
+
+// C++ operators go through the same (empty) layer as in the other tools, so
+// that this detector stays a fair baseline.
+void interpose::onNew(std::size_t /*size*/, void* /*result*/,
+                      void* /*frame*/) {}
+
+void interpose::onDelete(void* /*pointer*/, std::size_t /*size*/,
+                         void* /*frame*/) {}
 
 extern "C" void* INTERPOSE_FUNCTION_NAME(malloc)(size_t size) {
-    static auto* real = GET_REAL_FUNCTION(malloc);
-    return real(size);
+    return interpose::real::malloc(size);
 }
 INTERPOSE(malloc);
 
 extern "C" void INTERPOSE_FUNCTION_NAME(free)(void* pointer) {
-    static auto* real = GET_REAL_FUNCTION(free);
-    real(pointer);
+    interpose::real::free(pointer);
 }
 INTERPOSE(free);
 
 extern "C" void* INTERPOSE_FUNCTION_NAME(calloc)(size_t n, size_t size) {
-    static auto* real = GET_REAL_FUNCTION(calloc);
-    return real(n, size);
+    return interpose::real::calloc(n, size);
 }
 INTERPOSE(calloc);
 
 extern "C" void* INTERPOSE_FUNCTION_NAME(realloc)(void* pointer, size_t size) {
-    static auto* real = GET_REAL_FUNCTION(realloc);
-    return real(pointer, size);
+    return interpose::real::realloc(pointer, size);
 }
 INTERPOSE(realloc);
 
 #ifndef __APPLE__
 extern "C" void* INTERPOSE_FUNCTION_NAME(reallocarray)(void* pointer, size_t n,
                                                        size_t size) {
-    static auto* real = GET_REAL_FUNCTION(reallocarray);
-    return real(pointer, n, size);
+    return interpose::real::reallocarray(pointer, n, size);
 }
 INTERPOSE(reallocarray);
 #endif
@@ -38,14 +42,12 @@ INTERPOSE(reallocarray);
 extern "C" int INTERPOSE_FUNCTION_NAME(posix_memalign)(void** memptr,
                                                        size_t alignment,
                                                        size_t size) {
-    static auto* real = GET_REAL_FUNCTION(posix_memalign);
-    return real(memptr, alignment, size);
+    return interpose::real::posix_memalign(memptr, alignment, size);
 }
 INTERPOSE(posix_memalign);
 
 extern "C" void* INTERPOSE_FUNCTION_NAME(aligned_alloc)(size_t alignment,
                                                         size_t size) {
-    static auto* real = GET_REAL_FUNCTION(aligned_alloc);
-    return real(alignment, size);
+    return interpose::real::aligned_alloc(alignment, size);
 }
 INTERPOSE(aligned_alloc);
@@ -0,0 +1,274 @@
+#ifndef DISTRIBUTION_BINARY_HPP
+#define DISTRIBUTION_BINARY_HPP
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <span>
+#include <string>
+#include <vector>
+
+#include "json.hpp"
+
+// Binary distribution format (version 1), equivalent to distribution.json but
+// usable straight from a memory mapping, without parsing.
+//
+// The file is a Header, followed by 8-byte words:
+//   - nBins size classes,
+//   - nBins bin counts,
+//   - nLifetimeBins LifetimeBin: bin, survivors, then the allocation and the
+//     nanosecond lifetime histograms of kLifetimeBuckets buckets each.
+// Everything is in native byte order. checksum is the FNV-1a hash of all bytes
+// after the header. Fields which are optional in JSON are only meaningful with
+// their flag set.
+
+namespace distribution::binary {
+constexpr std::array<char, 8> kMagic = {'L', 'I', 'T', 'T', 'D', 'I', 'S', 'T'};
+constexpr std::uint32_t kVersion = 1;
+constexpr std::size_t kLifetimeBuckets = 64;
+
+constexpr std::uint32_t kHasMaxLiveAllocationsError = 0x1;
+constexpr std::uint32_t kHasSampleRate = 0x2;
+constexpr std::uint32_t kHasLifetimes = 0x4;
+
+struct Header {
+    std::array<char, 8> magic;
+    std::uint32_t version;
+    std::uint32_t flags;
+    std::uint64_t checksum;
+    std::uint64_t nBins;
+    std::int64_t maxLiveAllocations;
+    std::int64_t maxLiveAllocationsError;
+    std::uint64_t ignored;
+    std::uint64_t sampleRate;
+    std::uint64_t lifetimeSampleRate;
+    std::uint64_t nLifetimeBins;
+};
+
+struct LifetimeBin {
+    std::uint64_t bin;
+    std::uint64_t survivors;
+    std::array<std::uint64_t, kLifetimeBuckets> allocations;
+    std::array<std::uint64_t, kLifetimeBuckets> nanoseconds;
+};
+
+static_assert(sizeof(Header) % sizeof(std::uint64_t) == 0);
+static_assert(sizeof(LifetimeBin)
+              == (2 + (2 * kLifetimeBuckets)) * sizeof(std::uint64_t));
+
+namespace detail {
+inline std::uint64_t checksum(std::span<const char> bytes) {
+    std::uint64_t hash = 0xCBF29CE484222325;
+    for (const char byte : bytes) {
+        hash = (hash ^ static_cast<std::uint8_t>(byte)) * 0x100000001B3;
+    }
+    return hash;
+}
+
+template <typename T>
+void append(std::string& out, const T& value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+} // namespace detail
+
+inline bool isBinary(std::span<const char> data) {
+    return data.size() >= kMagic.size()
+           && std::equal(kMagic.begin(), kMagic.end(), data.begin());
+}
+
+// A validated distribution, pointing into memory it does not own.
+class View {
+  public:
+    // Returns an empty optional, and sets error, if data does not hold a valid
+    // distribution. data must be 8-byte aligned.
+    static std::optional<View> parse(std::span<const char> data,
+                                     std::string& error) {
+        if (reinterpret_cast<std::uintptr_t>(data.data())
+                % alignof(std::uint64_t)
+            != 0) {
+            error = "misaligned distribution data";
+            return std::nullopt;
+        }
+        if (data.size() < sizeof(Header) || !isBinary(data)) {
+            error = "not a binary distribution";
+            return std::nullopt;
+        }
+
+        View view;
+        view.header = reinterpret_cast<const Header*>(data.data());
+        if (view.header->version != kVersion) {
+            error = "unsupported binary distribution version";
+            return std::nullopt;
+        }
+
+        // Sizes are checked one by one so that nothing can overflow.
+        auto payload = data.subspan(sizeof(Header));
+        const auto words = payload.size() / sizeof(std::uint64_t);
+        const auto nBins = view.header->nBins;
+        const auto nLifetimeBins = view.header->nLifetimeBins;
+        constexpr auto kLifetimeBinWords
+            = sizeof(LifetimeBin) / sizeof(std::uint64_t);
+        if (payload.size() % sizeof(std::uint64_t) != 0 || nBins > words / 2
+            || nLifetimeBins > (words - (2 * nBins)) / kLifetimeBinWords
+            || words != (2 * nBins) + (nLifetimeBins * kLifetimeBinWords)) {
+            error = "truncated binary distribution";
+            return std::nullopt;
+        }
+        if (detail::checksum(payload) != view.header->checksum) {
+            error = "binary distribution checksum mismatch";
+            return std::nullopt;
+        }
+
+        const auto* words64
+            = reinterpret_cast<const std::uint64_t*>(payload.data());
+        view.sizeClassesData = {words64, nBins};
+        view.binsData = {words64 + nBins, nBins};
+        view.lifetimesData
+            = {reinterpret_cast<const LifetimeBin*>(words64 + (2 * nBins)),
+               nLifetimeBins};
+        return view;
+    }
+
+    [[nodiscard]] const Header& getHeader() const {
+        return *header;
+    }
+
+    [[nodiscard]] std::span<const std::uint64_t> sizeClasses() const {
+        return sizeClassesData;
+    }
+
+    [[nodiscard]] std::span<const std::uint64_t> bins() const {
+        return binsData;
+    }
+
+    // Empty unless the header has kHasLifetimes.
+    [[nodiscard]] std::span<const LifetimeBin> lifetimes() const {
+        return lifetimesData;
+    }
+
+  private:
+    View() = default;
+
+    const Header* header = nullptr;
+    std::span<const std::uint64_t> sizeClassesData;
+    std::span<const std::uint64_t> binsData;
+    std::span<const LifetimeBin> lifetimesData;
+};
+
+// Encodes a distribution, as dumped by the detector, in the binary format.
+inline std::string fromJson(const nlohmann::json& data) {
+    const auto sizeClasses
+        = data["sizeClasses"].get<std::vector<std::uint64_t>>();
+    auto bins = data["bins"].get<std::vector<std::uint64_t>>();
+    bins.resize(sizeClasses.size());
+
+    Header header{};
+    header.magic = kMagic;
+    header.version = kVersion;
+    header.nBins = sizeClasses.size();
+    header.maxLiveAllocations = data["maxLiveAllocations"].get<std::int64_t>();
+    header.ignored = data.value("ignored", std::uint64_t(0));
+    if (data.contains("maxLiveAllocationsError")) {
+        header.flags |= kHasMaxLiveAllocationsError;
+        header.maxLiveAllocationsError
+            = data["maxLiveAllocationsError"].get<std::int64_t>();
+    }
+    if (data.contains("sampleRate")) {
+        header.flags |= kHasSampleRate;
+        header.sampleRate = data["sampleRate"].get<std::uint64_t>();
+    }
+
+    std::vector<LifetimeBin> lifetimes;
+    if (data.contains("lifetimes")) {
+        header.flags |= kHasLifetimes;
+        header.lifetimeSampleRate
+            = data["lifetimes"]["sampleRate"].get<std::uint64_t>();
+        for (const auto& entry : data["lifetimes"]["bins"]) {
+            LifetimeBin bin{};
+            bin.bin = entry["bin"].get<std::uint64_t>();
+            bin.survivors = entry["survivors"].get<std::uint64_t>();
+            const auto allocations
+                = entry["allocations"].get<std::vector<std::uint64_t>>();
+            const auto nanoseconds
+                = entry["nanoseconds"].get<std::vector<std::uint64_t>>();
+            std::copy_n(allocations.begin(),
+                        std::min(allocations.size(), kLifetimeBuckets),
+                        bin.allocations.begin());
+            std::copy_n(nanoseconds.begin(),
+                        std::min(nanoseconds.size(), kLifetimeBuckets),
+                        bin.nanoseconds.begin());
+            lifetimes.push_back(bin);
+        }
+        header.nLifetimeBins = lifetimes.size();
+    }
+
+    std::string payload;
+    payload.reserve((2 * sizeClasses.size() * sizeof(std::uint64_t))
+                    + (lifetimes.size() * sizeof(LifetimeBin)));
+    for (const auto sizeClass : sizeClasses) {
+        detail::append(payload, sizeClass);
+    }
+    for (const auto bin : bins) {
+        detail::append(payload, bin);
+    }
+    for (const auto& bin : lifetimes) {
+        detail::append(payload, bin);
+    }
+    header.checksum = detail::checksum(payload);
+
+    std::string out;
+    out.reserve(sizeof(Header) + payload.size());
+    detail::append(out, header);
+    out.append(payload);
+    return out;
+}
+
+// Decodes a binary distribution to the JSON the detector would have dumped.
+inline nlohmann::json toJson(const View& view) {
+    const auto& header = view.getHeader();
+    nlohmann::json data = {
+        {"sizeClasses", std::vector<std::uint64_t>(view.sizeClasses().begin(),
+                                                   view.sizeClasses().end())},
+        {"bins",
+         std::vector<std::uint64_t>(view.bins().begin(), view.bins().end())},
+        {"maxLiveAllocations", header.maxLiveAllocations},
+        {"ignored", header.ignored},
+    };
+    if ((header.flags & kHasMaxLiveAllocationsError) != 0) {
+        data["maxLiveAllocationsError"] = header.maxLiveAllocationsError;
+    }
+    if ((header.flags & kHasSampleRate) != 0) {
+        data["sampleRate"] = header.sampleRate;
+    }
+
+    if ((header.flags & kHasLifetimes) != 0) {
+        // Histograms lose their trailing empty buckets, as in the detector.
+        const auto trimmed
+            = [](const std::array<std::uint64_t, kLifetimeBuckets>& buckets) {
+                  auto end = buckets.end();
+                  while (end != buckets.begin() && *(end - 1) == 0) {
+                      --end;
+                  }
+                  return std::vector<std::uint64_t>(buckets.begin(), end);
+              };
+
+        auto bins = nlohmann::json::array();
+        for (const auto& bin : view.lifetimes()) {
+            bins.push_back({
+                {"bin", bin.bin},
+                {"allocations", trimmed(bin.allocations)},
+                {"nanoseconds", trimmed(bin.nanoseconds)},
+                {"survivors", bin.survivors},
+            });
+        }
+        data["lifetimes"]
+            = {{"sampleRate", header.lifetimeSampleRate}, {"bins", bins}};
+    }
+    return data;
+}
+} // namespace distribution::binary
+
+#endif // DISTRIBUTION_BINARY_HPP
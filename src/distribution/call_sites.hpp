@@ -0,0 +1,291 @@
+#ifndef DISTRIBUTION_CALL_SITES_HPP
+#define DISTRIBUTION_CALL_SITES_HPP
+
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <ios>
+#include <new>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace distribution::call_sites {
+// Return addresses kept per call site, the allocator's caller first.
+constexpr std::size_t kMaxDepth = 8;
+constexpr std::size_t kCapacity = std::size_t(1) << 14;
+constexpr std::size_t kMaxProbes = 64;
+// Call sites printed in each section of the report.
+constexpr std::size_t kReportLimit = 50;
+
+using Frames = std::array<std::uintptr_t, kMaxDepth>;
+
+namespace detail {
+inline thread_local std::uintptr_t stackLow = 0;
+inline thread_local std::uintptr_t stackHigh = 0;
+inline thread_local bool resolvingStack = false;
+
+// pthread_getattr_np may allocate, which comes back here: until the bounds are
+// known, only the first frame is captured.
+inline bool resolveStackBounds() {
+    if (stackHigh != 0) {
+        return true;
+    }
+    if (resolvingStack) {
+        return false;
+    }
+
+    resolvingStack = true;
+#ifdef __APPLE__
+    // The stack address is its top.
+    stackHigh = reinterpret_cast<std::uintptr_t>(
+        pthread_get_stackaddr_np(pthread_self()));
+    stackLow = stackHigh - pthread_get_stacksize_np(pthread_self());
+#else
+    pthread_attr_t attributes;
+    if (pthread_getattr_np(pthread_self(), &attributes) == 0) {
+        void* address = nullptr;
+        std::size_t size = 0;
+        if (pthread_attr_getstack(&attributes, &address, &size) == 0) {
+            stackLow = reinterpret_cast<std::uintptr_t>(address);
+            stackHigh = stackLow + size;
+        }
+        pthread_attr_destroy(&attributes);
+    }
+#endif
+    resolvingStack = false;
+    return stackHigh != 0;
+}
+
+inline std::string describe(std::uintptr_t address) {
+    std::ostringstream out;
+    out << "0x" << std::hex << address;
+
+    Dl_info info;
+    if (dladdr(reinterpret_cast<void*>(address), &info) == 0) {
+        return out.str();
+    }
+
+    if (info.dli_sname != nullptr) {
+        int status = 0;
+        char* demangled
+            = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+        out << " " << (status == 0 ? demangled : info.dli_sname) << "+0x"
+            << (address - reinterpret_cast<std::uintptr_t>(info.dli_saddr));
+        std::free(demangled);
+    }
+    if (info.dli_fname != nullptr) {
+        out << " (" << info.dli_fname << "+0x"
+            << (address - reinterpret_cast<std::uintptr_t>(info.dli_fbase))
+            << ")";
+    }
+    return out.str();
+}
+} // namespace detail
+
+// Walks frame pointers from the frame of the allocation function itself (as
+// given by __builtin_frame_address(0)). The first return address is always
+// right; deeper ones need the program to keep frame pointers, and the walk
+// stops at the first frame which does not look sane.
+// This function CANNOT call any memory allocation functions.
+inline Frames capture(void* frame) {
+    Frames frames{};
+    const auto* current = static_cast<const std::uintptr_t*>(frame);
+    frames[0] = current[1];
+    if (!detail::resolveStackBounds()) {
+        return frames;
+    }
+
+    for (std::size_t depth = 1; depth < kMaxDepth; ++depth) {
+        const auto next = current[0];
+        if (next <= reinterpret_cast<std::uintptr_t>(current)
+            || next < detail::stackLow
+            || next + (2 * sizeof(std::uintptr_t)) > detail::stackHigh
+            || next % sizeof(std::uintptr_t) != 0) {
+            break;
+        }
+        current = reinterpret_cast<const std::uintptr_t*>(next);
+        if (current[1] == 0) {
+            break;
+        }
+        frames[depth] = current[1];
+    }
+    return frames;
+}
+
+// Lock-free open-addressing table of call sites, keyed by a hash of their
+// frames. Entries are never removed, and the table is mmap-ed, so recording
+// never allocates. Sites which do not fit are only counted as dropped.
+class Table {
+  public:
+    struct Site {
+        std::atomic_uint64_t key;
+        Frames frames;
+        std::atomic_uint64_t allocations;
+        std::atomic_uint64_t bytes;
+        // Weighted deaths of sampled objects, and the sums of their lifetimes.
+        std::atomic_uint64_t deaths;
+        std::atomic_uint64_t lifetimeAllocations;
+        std::atomic_uint64_t lifetimeNanoseconds;
+    };
+
+    bool init() {
+        void* memory = mmap(nullptr, kCapacity * sizeof(Site),
+                            PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) {
+            return false;
+        }
+        sites = static_cast<Site*>(memory);
+        for (std::size_t i = 0; i < kCapacity; ++i) {
+            new (&sites[i]) Site();
+        }
+        return true;
+    }
+
+    // Returns the index of the site plus one, or 0 if it was dropped.
+    // This function CANNOT call any memory allocation functions.
+    std::uint32_t record(void* frame, std::size_t size, std::uint64_t weight) {
+        const auto frames = capture(frame);
+        const auto key = hash(frames);
+        for (std::size_t probe = 0; probe < kMaxProbes; ++probe) {
+            const auto index = (key + probe) & (kCapacity - 1);
+            auto& site = sites[index];
+            auto existing = site.key.load(std::memory_order_acquire);
+            if (existing == 0) {
+                // Frames are written before the key is published; a racing
+                // thread inserting the same site just counts in it.
+                if (site.key.compare_exchange_strong(
+                        existing, kClaimed, std::memory_order_acq_rel)) {
+                    site.frames = frames;
+                    site.key.store(key, std::memory_order_release);
+                    existing = key;
+                }
+            }
+            while (existing == kClaimed) {
+                existing = site.key.load(std::memory_order_acquire);
+            }
+            if (existing == key) {
+                site.allocations.fetch_add(weight, std::memory_order_relaxed);
+                site.bytes.fetch_add(weight * size, std::memory_order_relaxed);
+                return static_cast<std::uint32_t>(index + 1);
+            }
+        }
+        dropped.fetch_add(weight, std::memory_order_relaxed);
+        return 0;
+    }
+
+    // This function CANNOT call any memory allocation functions.
+    void recordDeath(std::uint32_t site, std::uint64_t weight,
+                     std::uint64_t lifetimeAllocations,
+                     std::uint64_t lifetimeNanoseconds) {
+        if (site == 0) {
+            return;
+        }
+        auto& entry = sites[site - 1];
+        entry.deaths.fetch_add(weight, std::memory_order_relaxed);
+        entry.lifetimeAllocations.fetch_add(weight * lifetimeAllocations,
+                                            std::memory_order_relaxed);
+        entry.lifetimeNanoseconds.fetch_add(weight * lifetimeNanoseconds,
+                                            std::memory_order_relaxed);
+    }
+
+    // Writes the top call sites by bytes, then by allocation rate, given the
+    // time elapsed since recording started. Lifetimes are only known for
+    // sampled objects, one every lifetimeSampleRate bytes (0 if none is).
+    void report(std::ostream& out, double elapsedSeconds,
+                std::uint64_t lifetimeSampleRate) const {
+        std::vector<const Site*> used;
+        for (std::size_t i = 0; i < kCapacity; ++i) {
+            if (sites[i].key.load() > kClaimed) {
+                used.push_back(&sites[i]);
+            }
+        }
+
+        out << "Call sites: " << used.size() << " (" << dropped.load()
+            << " allocation(s) dropped)\n";
+        if (lifetimeSampleRate != 0) {
+            out << "Lifetimes: sampled every " << lifetimeSampleRate
+                << " B on average\n";
+        } else {
+            out << "Lifetimes: not sampled "
+                   "(LITTER_DETECTOR_LIFETIME_SAMPLE_RATE is 0)\n";
+        }
+        out << std::fixed << std::setprecision(1);
+
+        const auto section = [&](const char* title, auto greater) {
+            std::sort(used.begin(), used.end(), greater);
+            out << "\n==== Top call sites by " << title << " ====\n";
+            for (std::size_t rank = 0;
+                 rank < used.size() && rank < kReportLimit; ++rank) {
+                write(out, rank + 1, *used[rank], elapsedSeconds);
+            }
+        };
+        section("bytes", [](const Site* a, const Site* b) {
+            return a->bytes.load() > b->bytes.load();
+        });
+        section("allocation rate", [](const Site* a, const Site* b) {
+            return a->allocations.load() > b->allocations.load();
+        });
+    }
+
+  private:
+    static constexpr std::uint64_t kClaimed = 1;
+
+    static std::uint64_t hash(const Frames& frames) {
+        std::uint64_t hash = 0xCBF29CE484222325;
+        for (const auto address : frames) {
+            hash = (hash ^ address) * 0x100000001B3;
+        }
+        // 0 and kClaimed are reserved.
+        return std::max<std::uint64_t>(hash, kClaimed + 1);
+    }
+
+    static void write(std::ostream& out, std::size_t rank, const Site& site,
+                      double elapsedSeconds) {
+        const auto allocations = site.allocations.load();
+        const auto deaths = site.deaths.load();
+        out << "#" << rank << ": " << site.bytes.load() << " B in "
+            << allocations << " allocation(s)";
+        if (elapsedSeconds > 0) {
+            out << ", " << static_cast<double>(allocations) / elapsedSeconds
+                << " allocation(s)/s";
+        }
+        out << ", " << static_cast<double>(site.bytes.load())
+                           / static_cast<double>(std::max<std::uint64_t>(
+                               allocations, 1))
+            << " B on average";
+        if (deaths != 0) {
+            out << ", mean lifetime "
+                << static_cast<double>(site.lifetimeAllocations.load())
+                       / static_cast<double>(deaths)
+                << " allocation(s) / "
+                << static_cast<double>(site.lifetimeNanoseconds.load())
+                       / static_cast<double>(deaths) / 1e6
+                << " ms";
+        }
+        out << "\n";
+        for (const auto address : site.frames) {
+            if (address == 0) {
+                break;
+            }
+            out << "    " << detail::describe(address) << "\n";
+        }
+    }
+
+    Site* sites = nullptr;
+    std::atomic_uint64_t dropped = 0;
+};
+} // namespace distribution::call_sites
+
+#endif // DISTRIBUTION_CALL_SITES_HPP
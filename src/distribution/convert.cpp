@@ -0,0 +1,81 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <exception>
+#include <fstream>
+#include <ios>
+#include <iostream>
+#include <iterator>
+#include <span>
+#include <string>
+#include <vector>
+
+#include <argparse/argparse.hpp>
+
+#include "binary.hpp"
+#include "json.hpp"
+
+// Converts a distribution from JSON to the binary format, or back, depending on
+// the format of the input.
+int main(int argc, char** argv) {
+    auto program = argparse::ArgumentParser("convert_distribution", "",
+                                            argparse::default_arguments::help);
+    program.add_argument("-i", "--input")
+        .help("input file, generated by the detector or by this tool")
+        .default_value("distribution.json")
+        .metavar("FILE");
+    program.add_argument("-o", "--output")
+        .help("output file")
+        .required()
+        .metavar("FILE");
+
+    try {
+        program.parse_args(argc, argv);
+    } catch (const std::exception& err) {
+        std::cerr << err.what() << std::endl;
+        std::cerr << program;
+        std::exit(EXIT_FAILURE);
+    }
+
+    const auto input = program.get<std::string>("--input");
+    const auto output = program.get<std::string>("--output");
+
+    std::ifstream inputFile(input, std::ios::binary);
+    if (!inputFile) {
+        std::cerr << "Failed to open " << input << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+    // Kept in 8-byte words, as the binary format needs them aligned.
+    const std::string contents((std::istreambuf_iterator<char>(inputFile)),
+                               std::istreambuf_iterator<char>());
+    std::vector<std::uint64_t> words(
+        (contents.size() + sizeof(std::uint64_t) - 1) / sizeof(std::uint64_t));
+    std::copy(contents.begin(), contents.end(),
+              reinterpret_cast<char*>(words.data()));
+    const std::span<const char> data(
+        reinterpret_cast<const char*>(words.data()), contents.size());
+
+    std::ofstream outputFile(output, std::ios::binary);
+    if (!outputFile) {
+        std::cerr << "Failed to open " << output << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+
+    if (distribution::binary::isBinary(data)) {
+        std::string error;
+        const auto view = distribution::binary::View::parse(data, error);
+        if (!view) {
+            std::cerr << input << ": " << error << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+        outputFile << distribution::binary::toJson(*view).dump(4) << std::endl;
+    } else {
+        try {
+            outputFile << distribution::binary::fromJson(
+                nlohmann::json::parse(contents));
+        } catch (const std::exception& err) {
+            std::cerr << input << ": " << err.what() << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+    }
+}
@@ -1,35 +1,797 @@
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdlib.h> // NOLINT(modernize-deprecated-headers)
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include <algorithm>
+#include <array>
 #include <atomic>
+#include <bit>
 #include <cassert>
+#include <chrono>
+#include <cmath>
 #include <cstddef>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <deque>
-#include <filesystem>
 #include <fstream>
 #include <iostream>
 #include <iterator>
+#include <limits>
+#include <new>
 #include <string>
 #include <vector>
 
 #include <nlohmann/json.hpp> // NOLINT(misc-include-cleaner)
 
 #include <interpose.h>
+#include <interpose_new.h>
+
+#include "call_sites.hpp"
+#include "merge.hpp"
 
 namespace {
 const auto* kDefaultDataFilename = "distribution.json";
 const auto* kDefaultSizeClassScheme = "under-4096";
+const auto* kDefaultCallSitesFilename = "call-sites.txt";
+const std::size_t kCacheLineSize = 64;
+
+// In sharded mode, each thread publishes its live allocation count to the
+// global counter once it drifts this far from zero. The global count is thus
+// off by at most (kShardFlushThreshold - 1) per shard at any point in time.
+const std::int64_t kShardFlushThreshold = 64;
+
+// Size classes are looked up in a direct table for sizes up to
+// kDirectLookupLimit, and in log-linear buckets above that, each power of two
+// being split into 2^kLookupSubBucketBits buckets.
+const std::size_t kDirectLookupLimit = 4096;
+const int kDirectLookupExponent = std::bit_width(kDirectLookupLimit) - 1;
+const int kLookupSubBucketBits = 4;
+
+// Size classes of all schemes but under-4096 go up to kMaxSizeClass, so that
+// only absurdly large allocations are ignored.
+const std::size_t kMaxSizeClass = std::size_t(1) << 36;
+
+// In sampling mode, sampled live objects are remembered in a table of
+// kSampledTableCapacity entries. A counting filter of kSampledFilterSize
+// entries lets frees of objects which were never sampled skip the table.
+const std::size_t kSampledTableCapacity = std::size_t(1) << 16;
+const std::size_t kSampledFilterSize = std::size_t(1) << 18;
+// Sampled objects which are not found within that many slots are not tracked.
+const std::size_t kSampledMaxProbes = 64;
+
+// When call sites are recorded outside of sampling mode, the lifetimes of
+// objects are sampled every kCallSitesLifetimeSampleRate bytes on average,
+// unless another rate is given.
+const std::uint64_t kCallSitesLifetimeSampleRate = std::uint64_t(1) << 14;
+const std::size_t kLifetimeBuckets = 64;
 
 std::atomic_bool initialized = false;
 std::vector<std::size_t> sizeClasses;
+std::vector<std::uint32_t> sizeClassLookup;
 std::deque<std::atomic_uint64_t> bins;
 std::atomic_uint64_t ignored = 0;
 std::atomic_int64_t liveAllocations = 0;
 std::atomic_int64_t maxLiveAllocations = 0;
 std::string dataFilename;
+// In APPEND mode, the distribution is merged into the existing file at exit.
+bool append = false;
+distribution::merge::Mode mergeMode = distribution::merge::Mode::Sequential;
+
+// Per-thread counters, only incremented by their owning thread. Shards are
+// mmap-ed (never malloc-ed) and are never unmapped: when a thread exits, its
+// shard is merged into the global counters and recycled for the next thread.
+struct alignas(kCacheLineSize) Shard {
+    std::atomic_bool inUse = true;
+    Shard* next = nullptr;
+    std::atomic_int64_t liveAllocations = 0;
+    std::atomic_uint64_t ignored = 0;
+    std::atomic_uint64_t* bins = nullptr;
+};
+
+// Appends 2^subBucketBits size classes per power of two, aligned on their
+// spacing, until kMaxSizeClass. The relative error of each class is thus at
+// most 2^-subBucketBits.
+void appendLogLinearSizeClasses(int subBucketBits) {
+    while (sizeClasses.back() < kMaxSizeClass) {
+        const auto last = sizeClasses.back();
+        const auto step
+            = std::max<std::size_t>(std::bit_floor(last) >> subBucketBits, 1);
+        sizeClasses.push_back(((last / step) + 1) * step);
+    }
+}
+
+void appendLinearSizeClasses(std::size_t from, std::size_t to,
+                             std::size_t step) {
+    for (auto size = from; size <= to; size += step) {
+        sizeClasses.push_back(size);
+    }
+}
+
+// Size classes mirroring those of common allocators, as the largest request
+// size each class serves. Returns false for an unknown scheme.
+bool buildSizeClasses(const std::string& scheme) {
+    sizeClasses.clear();
+    if (scheme == "under-4096") {
+        appendLinearSizeClasses(1, 4096, 1);
+    } else if (scheme == "jemalloc") {
+        // A tiny class, quantum-spaced classes, then four per power of two.
+        sizeClasses.push_back(8);
+        appendLinearSizeClasses(16, 128, 16);
+        appendLogLinearSizeClasses(2);
+    } else if (scheme == "mimalloc") {
+        // Word-sized bins rounded to even word counts, then four per power of
+        // two.
+        sizeClasses.push_back(8);
+        appendLinearSizeClasses(16, 64, 16);
+        appendLogLinearSizeClasses(2);
+    } else if (scheme == "tcmalloc") {
+        // Classes follow tcmalloc's alignment rule (16 bytes up to 128, then an
+        // eighth of the power of two); its merging of classes spanning the
+        // same number of pages is not modeled.
+        sizeClasses.push_back(8);
+        appendLinearSizeClasses(16, 128, 16);
+        appendLogLinearSizeClasses(3);
+    } else if (scheme == "glibc") {
+        // 64-bit chunks carry an 8-byte header and are 16-byte aligned, with a
+        // minimum of 32 bytes. Small bins hold a single chunk size below 1024,
+        // large bins ranges of chunk sizes; a request of size s fits a chunk
+        // below hi if s <= hi - 24.
+        appendLinearSizeClasses(32 - 8, 1024 - 8, 16);
+        for (const auto& [from, to, step] :
+             {std::array<std::size_t, 3>{1088, 3136, 64},
+              std::array<std::size_t, 3>{3584, 10752, 512},
+              std::array<std::size_t, 3>{12288, 45056, 4096},
+              std::array<std::size_t, 3>{65536, 163840, 32768},
+              std::array<std::size_t, 3>{262144, 786432, 262144}}) {
+            for (auto hi = from; hi <= to; hi += step) {
+                sizeClasses.push_back(hi - 24);
+            }
+        }
+        appendLogLinearSizeClasses(2);
+    } else if (scheme == "log-linear") {
+        // At most 12.5% larger than any size it serves.
+        appendLinearSizeClasses(8, 64, 8);
+        appendLogLinearSizeClasses(3);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+std::size_t lookupBucket(std::size_t size) {
+    const auto exponent = std::bit_width(size) - 1;
+    const auto subBucket = (size >> (exponent - kLookupSubBucketBits))
+                           & ((std::size_t(1) << kLookupSubBucketBits) - 1);
+    return kDirectLookupLimit + 1
+           + ((exponent - kDirectLookupExponent) << kLookupSubBucketBits)
+           + subBucket;
+}
+
+// Each entry is the first size class fitting the smallest size mapped to it.
+void buildSizeClassLookup() {
+    const auto firstFit = [](std::size_t size) {
+        const auto it
+            = std::lower_bound(sizeClasses.begin(), sizeClasses.end(), size);
+        return static_cast<std::uint32_t>(std::min<std::size_t>(
+            std::distance(sizeClasses.begin(), it), sizeClasses.size() - 1));
+    };
+
+    sizeClassLookup.clear();
+    for (std::size_t size = 0; size <= kDirectLookupLimit; ++size) {
+        sizeClassLookup.push_back(firstFit(size));
+    }
+
+    for (int exponent = kDirectLookupExponent;
+         exponent < std::numeric_limits<std::size_t>::digits; ++exponent) {
+        const auto base = std::size_t(1) << exponent;
+        if (base > sizeClasses.back()) {
+            break;
+        }
+        for (std::size_t subBucket = 0;
+             subBucket < (std::size_t(1) << kLookupSubBucketBits);
+             ++subBucket) {
+            const auto size
+                = base + (subBucket << (exponent - kLookupSubBucketBits));
+            sizeClassLookup.push_back(firstFit(size));
+        }
+    }
+}
+
+// This function CANNOT call any memory allocation functions.
+// Assumes 0 < size <= sizeClasses.back().
+std::size_t sizeClassIndex(std::size_t size) {
+    if (size <= kDirectLookupLimit) {
+        return sizeClassLookup[size];
+    }
+
+    // Log-linear buckets may straddle many size classes boundaries, when the
+    // scheme is finer than the buckets: the class is searched for between the
+    // first fits of this bucket and of the next one.
+    const auto bucket = lookupBucket(size);
+    const auto first = sizeClasses.begin() + sizeClassLookup[bucket];
+    const auto last = bucket + 1 < sizeClassLookup.size()
+                          ? sizeClasses.begin() + sizeClassLookup[bucket + 1]
+                          : sizeClasses.end() - 1;
+    return std::distance(sizeClasses.begin(),
+                         std::lower_bound(first, last, size));
+}
+
+bool sharded = false;
+pthread_key_t shardKey;
+std::atomic<Shard*> shards = nullptr;
+std::atomic_uint64_t nShards = 0;
+thread_local Shard* localShard = nullptr;
+
+void updateMaxLiveAllocations(std::int64_t liveAllocationsSnapshot) {
+    auto maxLiveAllocationsSnapshot = maxLiveAllocations.load();
+    while (liveAllocationsSnapshot > maxLiveAllocationsSnapshot) {
+        maxLiveAllocations.compare_exchange_weak(maxLiveAllocationsSnapshot,
+                                                 liveAllocationsSnapshot);
+        maxLiveAllocationsSnapshot = maxLiveAllocations.load();
+    }
+}
+
+// Shards are flushed at exit while their owners may still be running, so even
+// their owners update them with read-modify-writes: a plain load and store
+// could undo a concurrent exchange, and count the same allocations twice. The
+// cache line is not shared, so the locked instruction is uncontended.
+void increment(std::atomic_uint64_t& counter) {
+    counter.fetch_add(1, std::memory_order_relaxed);
+}
+
+void addLiveAllocations(Shard& shard, std::int64_t delta) {
+    const auto local
+        = shard.liveAllocations.fetch_add(delta, std::memory_order_relaxed)
+          + delta;
+    if (local >= kShardFlushThreshold || local <= -kShardFlushThreshold) {
+        updateMaxLiveAllocations(liveAllocations
+                                 += shard.liveAllocations.exchange(
+                                     0, std::memory_order_relaxed));
+    }
+}
+
+void flushShard(Shard& shard) {
+    for (std::size_t i = 0; i < sizeClasses.size(); ++i) {
+        const auto count = shard.bins[i].exchange(0);
+        if (count != 0) {
+            bins[i] += count;
+        }
+    }
+    ignored += shard.ignored.exchange(0);
+    updateMaxLiveAllocations(liveAllocations
+                             += shard.liveAllocations.exchange(0));
+}
+
+void releaseShard(void* pointer) {
+    auto* shard = static_cast<Shard*>(pointer);
+    flushShard(*shard);
+    localShard = nullptr;
+    shard->inUse = false;
+}
+
+// This function CANNOT call any memory allocation functions.
+Shard* acquireShard() {
+    for (auto* shard = shards.load(); shard != nullptr; shard = shard->next) {
+        bool expected = false;
+        if (shard->inUse.compare_exchange_strong(expected, true)) {
+            return shard;
+        }
+    }
+
+    const auto size
+        = sizeof(Shard) + (sizeClasses.size() * sizeof(std::atomic_uint64_t));
+    void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        return nullptr;
+    }
+
+    auto* shard = new (memory) Shard();
+    shard->bins = reinterpret_cast<std::atomic_uint64_t*>(shard + 1);
+    for (std::size_t i = 0; i < sizeClasses.size(); ++i) {
+        new (&shard->bins[i]) std::atomic_uint64_t(0);
+    }
+
+    shard->next = shards.load();
+    while (!shards.compare_exchange_weak(shard->next, shard)) {
+    }
+    ++nShards;
+    return shard;
+}
+
+Shard* getLocalShard() {
+    if (localShard == nullptr) [[unlikely]] {
+        localShard = acquireShard();
+        if (localShard != nullptr) {
+            pthread_setspecific(shardKey, localShard);
+        }
+    }
+    return localShard;
+}
+
+// Mean number of bytes between two samples in sampling mode, 0 otherwise.
+std::uint64_t sampleRate = 0;
+// Mean number of bytes between two objects whose lifetime is tracked, when not
+// in sampling mode (where all sampled objects are tracked). 0, the default,
+// disables it.
+std::uint64_t lifetimeSampleRate = 0;
+// The rate actually used by the sampler, 0 when nothing is sampled.
+std::uint64_t samplerRate = 0;
+thread_local std::int64_t bytesUntilSample = 0;
+thread_local std::uint64_t samplerState = 0;
+
+// Estimated number of allocations so far, advanced by the weight of each
+// sample. Lifetimes in allocations are measured with it.
+std::atomic_uint64_t allocationClock = 0;
+
+// Call sites are recorded for every allocation, or only for sampled ones in
+// sampling mode.
+bool recordCallSites = false;
+distribution::call_sites::Table callSites;
+std::string callSitesFilename;
+std::uint64_t startNanoseconds = 0;
+
+struct Sample {
+    std::uint64_t weight;
+    std::uint32_t sizeClass;
+    std::uint32_t callSite;
+    std::uint64_t birthAllocation;
+    std::uint64_t birthNanoseconds;
+};
+
+class SpinLock {
+  public:
+    explicit SpinLock(std::atomic_flag& flag) : flag(flag) {
+        while (flag.test_and_set(std::memory_order_acquire)) {
+        }
+    }
+    ~SpinLock() {
+        flag.clear(std::memory_order_release);
+    }
+
+    SpinLock(const SpinLock&) = delete;
+    SpinLock& operator=(const SpinLock&) = delete;
+    SpinLock(SpinLock&&) = delete;
+    SpinLock& operator=(SpinLock&&) = delete;
+
+  private:
+    std::atomic_flag& flag;
+};
+
+// Replaces the pages of an anonymous mapping with fresh, zeroed ones, without
+// touching the pages which were never used.
+// This function CANNOT call any memory allocation functions.
+void zeroMapping(void* memory, std::size_t size) {
+    if (mmap(memory, size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0)
+        == MAP_FAILED) {
+        std::memset(memory, 0, size);
+    }
+}
+
+// Maps sampled live pointers to their Sample. Samples are rare, so the table
+// sits behind a spinlock; frees of pointers which were never sampled only read
+// their (atomic) filter counter. All memory comes from mmap.
+class SampledPointers {
+  public:
+    bool init() {
+        void* memory = mmap(nullptr, mappingSize(), PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) {
+            return false;
+        }
+
+        // Anonymous mappings are zeroed, which is what empty slots look like.
+        slots = static_cast<Slot*>(memory);
+        filter = reinterpret_cast<std::atomic_uint16_t*>(
+            slots + kSampledTableCapacity);
+        for (std::size_t i = 0; i < kSampledFilterSize; ++i) {
+            new (&filter[i]) std::atomic_uint16_t(0);
+        }
+        return true;
+    }
+
+    // Forgets all samples, in a child process whose other threads, which may
+    // have held the lock, are gone.
+    // This function CANNOT call any memory allocation functions.
+    void clear() {
+        locked.clear();
+        if (slots != nullptr) {
+            zeroMapping(slots, mappingSize());
+        }
+    }
+
+    // This function CANNOT call any memory allocation functions.
+    bool insert(void* pointer, const Sample& sample) {
+        const auto key = reinterpret_cast<std::uintptr_t>(pointer);
+        auto& counter = filter[hash(key) & (kSampledFilterSize - 1)];
+        if (counter.load(std::memory_order_relaxed)
+            == std::numeric_limits<std::uint16_t>::max()) {
+            return false;
+        }
+
+        const SpinLock lock(locked);
+        for (std::size_t probe = 0; probe < kSampledMaxProbes; ++probe) {
+            const auto index
+                = (hash(key) + probe) & (kSampledTableCapacity - 1);
+            if (slots[index].key == 0) {
+                slots[index] = {key, sample};
+                ++counter;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // This function CANNOT call any memory allocation functions.
+    bool erase(void* pointer, Sample& sample) {
+        const auto key = reinterpret_cast<std::uintptr_t>(pointer);
+        auto& counter = filter[hash(key) & (kSampledFilterSize - 1)];
+        if (counter.load(std::memory_order_relaxed) == 0) [[likely]] {
+            return false;
+        }
+
+        const SpinLock lock(locked);
+        for (std::size_t probe = 0; probe < kSampledMaxProbes; ++probe) {
+            const auto index
+                = (hash(key) + probe) & (kSampledTableCapacity - 1);
+            if (slots[index].key == 0) {
+                return false;
+            }
+            if (slots[index].key == key) {
+                sample = slots[index].sample;
+                shiftBackward(index);
+                --counter;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    template <typename Function>
+    void forEach(Function function) {
+        const SpinLock lock(locked);
+        for (std::size_t i = 0; i < kSampledTableCapacity; ++i) {
+            if (slots[i].key != 0) {
+                function(slots[i].sample);
+            }
+        }
+    }
+
+  private:
+    struct Slot {
+        std::uintptr_t key;
+        Sample sample;
+    };
+
+    static std::size_t mappingSize() {
+        return (kSampledTableCapacity * sizeof(Slot))
+               + (kSampledFilterSize * sizeof(std::atomic_uint16_t));
+    }
+
+    static std::size_t hash(std::uintptr_t key) {
+        return static_cast<std::size_t>((key >> 4) * 0x9E3779B97F4A7C15ULL
+                                        >> 32);
+    }
+
+    // Backward-shift deletion, so that lookups can stop at the first empty
+    // slot without tombstones piling up.
+    void shiftBackward(std::size_t hole) {
+        const auto mask = kSampledTableCapacity - 1;
+        for (auto index = (hole + 1) & mask; slots[index].key != 0;
+             index = (index + 1) & mask) {
+            const auto home = hash(slots[index].key) & mask;
+            if (((index - home) & mask) >= ((index - hole) & mask)) {
+                slots[hole] = slots[index];
+                hole = index;
+            }
+        }
+        slots[hole] = {};
+    }
+
+    Slot* slots = nullptr;
+    std::atomic_uint16_t* filter = nullptr;
+    std::atomic_flag locked;
+} sampledPointers;
+
+// Per size class, weighted histograms of the lifetimes of sampled objects, in
+// allocations and in nanoseconds. Bucket 0 holds lifetimes of 0, and bucket
+// k > 0 those in [2^(k-1), 2^k). Memory comes from mmap, so only the size
+// classes actually sampled are ever touched.
+class Lifetimes {
+  public:
+    enum Unit : std::size_t { Allocations, Nanoseconds, kUnits };
+
+    bool init(std::size_t nSizeClasses) {
+        size = nSizeClasses * kUnits * kLifetimeBuckets * sizeof(std::uint64_t);
+        void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) {
+            return false;
+        }
+        counts = static_cast<std::uint64_t*>(memory);
+        return true;
+    }
+
+    // This function CANNOT call any memory allocation functions.
+    void clear() {
+        locked.clear();
+        if (counts != nullptr) {
+            zeroMapping(counts, size);
+        }
+    }
+
+    // This function CANNOT call any memory allocation functions.
+    void record(const Sample& sample, std::uint64_t deathAllocation,
+                std::uint64_t deathNanoseconds) {
+        const SpinLock lock(locked);
+        histogram(sample.sizeClass, Allocations)[bucket(
+            deathAllocation - sample.birthAllocation)]
+            += sample.weight;
+        histogram(sample.sizeClass, Nanoseconds)[bucket(
+            deathNanoseconds - sample.birthNanoseconds)]
+            += sample.weight;
+    }
+
+    std::uint64_t* histogram(std::size_t sizeClass, Unit unit) {
+        return counts + ((sizeClass * kUnits + unit) * kLifetimeBuckets);
+    }
+
+  private:
+    static std::size_t bucket(std::uint64_t lifetime) {
+        return std::min<std::size_t>(std::bit_width(lifetime),
+                                     kLifetimeBuckets - 1);
+    }
+
+    std::uint64_t* counts = nullptr;
+    std::size_t size = 0;
+    std::atomic_flag locked;
+} lifetimes;
+
+std::uint64_t nowNanoseconds() {
+    return static_cast<std::uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch())
+            .count());
+}
+
+// xorshift64*, only used to place samples, so quality matters little.
+double nextUniform() {
+    samplerState ^= samplerState >> 12;
+    samplerState ^= samplerState << 25;
+    samplerState ^= samplerState >> 27;
+    const auto value = samplerState * 0x2545F4914F6CDD1DULL;
+    return static_cast<double>(value >> 11) * 0x1.0p-53;
+}
+
+// Bytes until the next sample, exponentially distributed so that sample points
+// form a Poisson process over the allocated bytes.
+std::int64_t nextSampleInterval() {
+    const auto interval
+        = -std::log(1.0 - nextUniform()) * static_cast<double>(samplerRate);
+    return static_cast<std::int64_t>(interval) + 1;
+}
+
+// An object of the given size is sampled with probability 1 - exp(-size/rate),
+// so it stands for the inverse of that many objects. The weight is rounded
+// randomly, which keeps the integer counters unbiased.
+std::uint64_t sampleWeight(std::size_t size) {
+    const auto weight = -1.0
+                        / std::expm1(-static_cast<double>(size)
+                                     / static_cast<double>(samplerRate));
+    const auto whole = std::floor(weight);
+    return static_cast<std::uint64_t>(whole)
+           + (nextUniform() < weight - whole ? 1 : 0);
+}
+
+// In sampling mode, sampled objects are counted in bins (and live ones in
+// liveAllocations) with their weight. In all modes, sampled objects are
+// remembered until they are freed, to record their lifetime.
+// This function CANNOT call any memory allocation functions.
+template <bool NewAlloc>
+void sampleAllocation(std::size_t size, void* result, void* frame,
+                      std::uint32_t callSite) {
+    if (samplerState == 0) [[unlikely]] {
+        samplerState = (reinterpret_cast<std::uintptr_t>(&samplerState)
+                        ^ nowNanoseconds())
+                       | 1;
+        bytesUntilSample = nextSampleInterval();
+    }
+
+    bytesUntilSample -= static_cast<std::int64_t>(size);
+    if (bytesUntilSample > 0) [[likely]] {
+        return;
+    }
+    bytesUntilSample = nextSampleInterval();
+
+    const auto weight = sampleWeight(size);
+    const auto birthAllocation = allocationClock += weight;
+    if (size > sizeClasses.back()) {
+        if (sampleRate != 0) {
+            ignored += weight;
+        }
+        return;
+    }
+
+    const auto index = sizeClassIndex(size);
+    if (sampleRate != 0) {
+        bins[index] += weight;
+        if (recordCallSites) {
+            callSite = callSites.record(frame, size, weight);
+        }
+    }
+
+    if (!NewAlloc || result == nullptr) {
+        return;
+    }
+
+    const Sample sample{weight, static_cast<std::uint32_t>(index), callSite,
+                        birthAllocation, nowNanoseconds()};
+    if (sampledPointers.insert(result, sample) && sampleRate != 0) {
+        updateMaxLiveAllocations(liveAllocations
+                                 += static_cast<std::int64_t>(weight));
+    }
+}
+
+// This function CANNOT call any memory allocation functions.
+void recordDeath(const Sample& sample) {
+    const auto deathAllocation = allocationClock.load();
+    const auto deathNanoseconds = nowNanoseconds();
+    lifetimes.record(sample, deathAllocation, deathNanoseconds);
+    if (recordCallSites) {
+        callSites.recordDeath(sample.callSite, sample.weight,
+                              deathAllocation - sample.birthAllocation,
+                              deathNanoseconds - sample.birthNanoseconds);
+    }
+    if (sampleRate != 0) {
+        liveAllocations -= static_cast<std::int64_t>(sample.weight);
+    }
+}
+
+// This function CANNOT call any memory allocation functions.
+void forgetSample(void* pointer) {
+    Sample sample{};
+    if (sampledPointers.erase(pointer, sample)) [[unlikely]] {
+        recordDeath(sample);
+    }
+}
+
+// Lifetimes are written per size class which was sampled at all, histograms
+// without their trailing empty buckets. Survivors are the (weighted) sampled
+// objects still alive at exit, whose lifetime is unknown.
+nlohmann::json dumpLifetimes() { // NOLINT(misc-include-cleaner)
+    std::vector<std::uint64_t> survivors(sizeClasses.size());
+    sampledPointers.forEach([&survivors](const Sample& sample) {
+        survivors[sample.sizeClass] += sample.weight;
+    });
+
+    const auto trimmed = [](const std::uint64_t* histogram) {
+        std::vector<std::uint64_t> buckets(histogram,
+                                           histogram + kLifetimeBuckets);
+        while (!buckets.empty() && buckets.back() == 0) {
+            buckets.pop_back();
+        }
+        return buckets;
+    };
+
+    auto perSizeClass = nlohmann::json::array();
+    for (std::size_t i = 0; i < sizeClasses.size(); ++i) {
+        auto allocations
+            = trimmed(lifetimes.histogram(i, Lifetimes::Allocations));
+        if (allocations.empty() && survivors[i] == 0) {
+            continue;
+        }
+        perSizeClass.push_back({
+            {"bin", i},
+            {"allocations", std::move(allocations)},
+            {"nanoseconds",
+             trimmed(lifetimes.histogram(i, Lifetimes::Nanoseconds))},
+            {"survivors", survivors[i]},
+        });
+    }
+
+    return {{"sampleRate", samplerRate}, {"bins", perSizeClass}};
+}
+
+std::string readFile(int fd) {
+    std::string contents;
+    std::array<char, 65536> buffer{};
+    while (true) {
+        const auto count = read(fd, buffer.data(), buffer.size());
+        if (count <= 0) {
+            return contents;
+        }
+        contents.append(buffer.data(), count);
+    }
+}
+
+// In APPEND mode, the file is only accessed under a lock, so that processes
+// running at the same time (a parallel build, a forking server) merge their
+// distributions one after the other. The existing distribution, or null if
+// there is none yet.
+nlohmann::json readLocked() { // NOLINT(misc-include-cleaner)
+    const int fd = open(dataFilename.c_str(), O_RDONLY);
+    if (fd == -1) {
+        return nullptr;
+    }
+    flock(fd, LOCK_SH);
+    const auto contents = readFile(fd);
+    close(fd);
+    if (contents.empty()) {
+        return nullptr;
+    }
+    return nlohmann::json::parse(contents);
+}
+
+void writeMerged(nlohmann::json& data) { // NOLINT(misc-include-cleaner)
+    const int fd = open(dataFilename.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd == -1 || flock(fd, LOCK_EX) != 0) {
+        std::cerr << "Could not lock " << dataFilename << "." << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    const auto contents = readFile(fd);
+    std::string error;
+    if (!contents.empty()
+        && !distribution::merge::merge(data, nlohmann::json::parse(contents),
+                                       mergeMode, error)) {
+        // Another process created the file with other size classes: keep this
+        // distribution aside rather than losing it.
+        close(fd);
+        const auto fallback
+            = dataFilename + "." + std::to_string(getpid());
+        std::cerr << dataFilename << ": " << error << ", writing to "
+                  << fallback << " instead." << std::endl;
+        std::ofstream output(fallback);
+        output << data.dump(4) << std::endl;
+        return;
+    }
+
+    const auto output = data.dump(4) + "\n";
+    bool written = ftruncate(fd, 0) == 0;
+    for (std::size_t offset = 0; written && offset < output.size();) {
+        const auto count = pwrite(fd, output.data() + offset,
+                                  output.size() - offset,
+                                  static_cast<off_t>(offset));
+        written = count > 0;
+        offset += written ? count : 0;
+    }
+    close(fd);
+    if (!written) {
+        std::cerr << "Could not write " << dataFilename << "." << std::endl;
+        exit(EXIT_FAILURE);
+    }
+}
+
+// A forked child inherits the counters of its parent, which would count every
+// allocation made before the fork twice once both have written their
+// distribution. The child starts from scratch instead; the shards of the
+// parent's other threads, which are gone, are recycled.
+void resetInChild() {
+    for (auto& bin : bins) {
+        bin = 0;
+    }
+    ignored = 0;
+    liveAllocations = 0;
+    maxLiveAllocations = 0;
+
+    for (auto* shard = shards.load(); shard != nullptr; shard = shard->next) {
+        for (std::size_t i = 0; i < sizeClasses.size(); ++i) {
+            shard->bins[i] = 0;
+        }
+        shard->ignored = 0;
+        shard->liveAllocations = 0;
+        shard->inUse = shard == localShard;
+    }
+
+    sampledPointers.clear();
+    lifetimes.clear();
+}
 
 const struct Initialization {
     Initialization() {
@@ -38,31 +800,32 @@ const struct Initialization {
             dataFilename = env;
         }
 
-        if (std::getenv("LITTER_DETECTOR_APPEND") != nullptr
-            && std::filesystem::exists(dataFilename)) {
-            std::ifstream inputFile(dataFilename);
-            nlohmann::json data; // NOLINT(misc-include-cleaner)
-            inputFile >> data;
+        append = std::getenv("LITTER_DETECTOR_APPEND") != nullptr;
+        // Processes appending at the same time can have their peaks coincide.
+        if (const char* env = std::getenv("LITTER_DETECTOR_CONCURRENT")) {
+            if (std::atoi(env) != 0) {
+                mergeMode = distribution::merge::Mode::Concurrent;
+            }
+        }
 
+        nlohmann::json saved; // NOLINT(misc-include-cleaner)
+        if (append) {
+            saved = readLocked();
+        }
+
+        if (saved.is_object()) {
             // Note: APPEND will ignore SIZE_CLASSES, and just use the existing
             // ones.
-            sizeClasses = data["sizeClasses"].get<std::vector<std::size_t>>();
-            const auto savedBins
-                = data["bins"].get<std::vector<std::uint64_t>>();
-            bins = std::deque<std::atomic_uint64_t>(savedBins.begin(),
-                                                    savedBins.end());
+            sizeClasses
+                = saved["sizeClasses"].get<std::vector<std::size_t>>();
+            bins.resize(sizeClasses.size());
         } else {
             std::string sizeClassScheme = kDefaultSizeClassScheme;
             if (const char* env = std::getenv("LITTER_SIZE_CLASSES")) {
                 sizeClassScheme = env;
             }
 
-            if (sizeClassScheme == "under-4096") {
-                sizeClasses.reserve(4096);
-                for (std::size_t i = 1; i <= 4096; ++i) {
-                    sizeClasses.push_back(i);
-                }
-            } else {
+            if (!buildSizeClasses(sizeClassScheme)) {
                 std::cerr << "Invalid size class scheme." << std::endl;
                 exit(EXIT_FAILURE);
             }
@@ -70,13 +833,79 @@ const struct Initialization {
             bins.resize(sizeClasses.size());
         }
 
+        buildSizeClassLookup();
+
+        if (const char* env = std::getenv("LITTER_DETECTOR_SHARDED")) {
+            sharded = std::atoi(env) != 0;
+        }
+
+        if (const char* env = std::getenv("LITTER_DETECTOR_SAMPLE_RATE")) {
+            sampleRate = std::strtoull(env, nullptr, 10);
+        }
+
+        if (const char* env = std::getenv("LITTER_DETECTOR_CALL_SITES")) {
+            recordCallSites = std::atoi(env) != 0;
+        }
+
+        // Call sites are reported with the lifetimes of their objects.
+        if (recordCallSites) {
+            lifetimeSampleRate = kCallSitesLifetimeSampleRate;
+        }
+        if (const char* env
+            = std::getenv("LITTER_DETECTOR_LIFETIME_SAMPLE_RATE")) {
+            lifetimeSampleRate = std::strtoull(env, nullptr, 10);
+        }
+
+        // Sampled events are rare enough not to need shards.
+        if (sampleRate != 0) {
+            sharded = false;
+        }
+
+        samplerRate = sampleRate != 0 ? sampleRate : lifetimeSampleRate;
+        if (samplerRate != 0
+            && (!sampledPointers.init()
+                || !lifetimes.init(sizeClasses.size()))) {
+            std::cerr << "Could not allocate the sampled pointers table."
+                      << std::endl;
+            exit(EXIT_FAILURE);
+        }
+
+        callSitesFilename = kDefaultCallSitesFilename;
+        if (const char* env = std::getenv("LITTER_CALL_SITES_FILENAME")) {
+            callSitesFilename = env;
+        }
+
+        if (recordCallSites && !callSites.init()) {
+            std::cerr << "Could not allocate the call sites table."
+                      << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        startNanoseconds = nowNanoseconds();
+
+        if (sharded && pthread_key_create(&shardKey, &releaseShard) != 0) {
+            std::cerr << "Could not create shard key." << std::endl;
+            exit(EXIT_FAILURE);
+        }
+
+        if (pthread_atfork(nullptr, nullptr, &resetInChild) != 0) {
+            std::cerr << "Could not register fork handler." << std::endl;
+            exit(EXIT_FAILURE);
+        }
+
         initialized = true;
     }
 
     ~Initialization() {
         initialized = false;
 
-        const nlohmann::json data = // NOLINT(misc-include-cleaner)
+        if (sharded) {
+            for (auto* shard = shards.load(); shard != nullptr;
+                 shard = shard->next) {
+                flushShard(*shard);
+            }
+        }
+
+        nlohmann::json data = // NOLINT(misc-include-cleaner)
             {
                 {"sizeClasses", sizeClasses},
                 {"bins", std::vector<std::uint64_t>(bins.begin(), bins.end())},
@@ -84,8 +913,36 @@ const struct Initialization {
                 {"ignored", ignored.load()},
             };
 
-        std::ofstream output(dataFilename);
-        output << data.dump(4) << std::endl;
+        if (sharded) {
+            data["maxLiveAllocationsError"]
+                = static_cast<std::int64_t>(nShards.load())
+                  * (kShardFlushThreshold - 1);
+        }
+
+        // Counts are estimates, scaled up from the sampled allocations.
+        if (sampleRate != 0) {
+            data["sampleRate"] = sampleRate;
+        }
+
+        if (samplerRate != 0) {
+            data["lifetimes"] = dumpLifetimes();
+        }
+
+        if (append) {
+            writeMerged(data);
+        } else {
+            std::ofstream output(dataFilename);
+            output << data.dump(4) << std::endl;
+        }
+
+        if (recordCallSites) {
+            std::ofstream report(callSitesFilename);
+            callSites.report(report,
+                             static_cast<double>(nowNanoseconds()
+                                                 - startNanoseconds)
+                                 / 1e9,
+                             samplerRate);
+        }
     }
 
     Initialization(const Initialization&) = delete;
@@ -95,80 +952,164 @@ const struct Initialization {
 } _;
 
 // This function CANNOT call any memory allocation functions.
+// frame is the frame of the interposed function, where call sites start.
 template <bool NewAlloc>
-void processAllocation(std::size_t size) {
+void processAllocation(std::size_t size, void* result, void* frame) {
     if (size == 0) {
         return;
     }
 
-    if (!initialized) {
+    if (!initialized || interpose::insideOperator()) {
         return;
     }
 
+    std::uint32_t callSite = 0;
+    if (recordCallSites && sampleRate == 0) {
+        callSite = callSites.record(frame, size, 1);
+    }
+
+    if (samplerRate != 0) {
+        sampleAllocation<NewAlloc>(size, result, frame, callSite);
+    }
+
+    if (sampleRate != 0) {
+        return;
+    }
+
+    Shard* shard = sharded ? getLocalShard() : nullptr;
+
     if (size > sizeClasses.back()) {
-        ++ignored;
+        if (shard != nullptr) {
+            increment(shard->ignored);
+        } else {
+            ++ignored;
+        }
+        return;
+    }
+
+    const auto index = sizeClassIndex(size);
+
+    if (shard != nullptr) {
+        increment(shard->bins[index]);
+        if constexpr (NewAlloc) {
+            addLiveAllocations(*shard, 1);
+        }
         return;
     }
 
-    const auto it
-        = std::lower_bound(sizeClasses.begin(), sizeClasses.end(), size);
-    const auto index = std::distance(sizeClasses.begin(), it);
     ++bins[index];
 
     if constexpr (NewAlloc) {
-        const auto liveAllocationsSnapshot = ++liveAllocations;
-        auto maxLiveAllocationsSnapshot = maxLiveAllocations.load();
-        while (liveAllocationsSnapshot > maxLiveAllocationsSnapshot) {
-            maxLiveAllocations.compare_exchange_weak(maxLiveAllocationsSnapshot,
-                                                     liveAllocationsSnapshot);
-            maxLiveAllocationsSnapshot = maxLiveAllocations.load();
-        }
+        updateMaxLiveAllocations(++liveAllocations);
     }
 }
 
 void processFree(void* pointer) {
-    if (pointer == nullptr) {
+    if (pointer == nullptr || interpose::insideOperator()) {
+        return;
+    }
+
+    if (samplerRate != 0 && initialized) {
+        forgetSample(pointer);
+    }
+
+    if (sampleRate != 0) {
         return;
     }
 
+    if (sharded && initialized) {
+        if (auto* shard = getLocalShard()) {
+            addLiveAllocations(*shard, -1);
+            return;
+        }
+    }
+
     --liveAllocations;
 }
+
+// A sampled object keeps its sample across reallocations: it is taken out of
+// the table before the object is actually reallocated, as its address may be
+// reused right after, and put back under the new address with its new size.
+bool processReallocation(void* pointer, Sample& sample) {
+    return pointer != nullptr && samplerRate != 0 && initialized
+           && sampledPointers.erase(pointer, sample);
+}
+
+// This function CANNOT call any memory allocation functions.
+void processReallocated(Sample sample, void* pointer, std::size_t size,
+                        void* result) {
+    if (result == nullptr) {
+        // A failed reallocation leaves the object where it was.
+        if (size == 0 || !sampledPointers.insert(pointer, sample)) {
+            recordDeath(sample);
+        }
+        return;
+    }
+
+    if (size > sizeClasses.back()) {
+        recordDeath(sample);
+        return;
+    }
+    sample.sizeClass = static_cast<std::uint32_t>(sizeClassIndex(size));
+    if (!sampledPointers.insert(result, sample)) {
+        recordDeath(sample);
+    }
+}
 } // namespace
 
+void interpose::onNew(std::size_t size, void* result, void* frame) {
+    processAllocation<true>(size, result, frame);
+}
+
+// Objects are only counted, so the size from sized deletes is not needed.
+void interpose::onDelete(void* pointer, std::size_t /*size*/,
+                         void* /*frame*/) {
+    processFree(pointer);
+}
+
 extern "C" void* INTERPOSE_FUNCTION_NAME(malloc)(size_t size) {
-    static auto* next = GET_REAL_FUNCTION(malloc);
-    processAllocation<true>(size);
-    return next(size);
+    void* result = interpose::real::malloc(size);
+    processAllocation<true>(size, result, __builtin_frame_address(0));
+    return result;
 }
 INTERPOSE(malloc);
 
 extern "C" void INTERPOSE_FUNCTION_NAME(free)(void* pointer) {
-    static auto* next = GET_REAL_FUNCTION(free);
     processFree(pointer);
-    next(pointer);
+    interpose::real::free(pointer);
 }
 INTERPOSE(free);
 
 extern "C" void* INTERPOSE_FUNCTION_NAME(calloc)(size_t n, size_t size) {
-    static auto* next = GET_REAL_FUNCTION(calloc);
-    processAllocation<true>(n * size);
-    return next(n, size);
+    void* result = interpose::real::calloc(n, size);
+    processAllocation<true>(n * size, result, __builtin_frame_address(0));
+    return result;
 }
 INTERPOSE(calloc);
 
 extern "C" void* INTERPOSE_FUNCTION_NAME(realloc)(void* pointer, size_t size) {
-    static auto* next = GET_REAL_FUNCTION(realloc);
-    processAllocation<false>(size);
-    return next(pointer, size);
+    Sample sample{};
+    const bool sampled = processReallocation(pointer, sample);
+    void* result = interpose::real::realloc(pointer, size);
+    processAllocation<false>(size, result, __builtin_frame_address(0));
+    if (sampled) {
+        processReallocated(sample, pointer, size, result);
+    }
+    return result;
 }
 INTERPOSE(realloc);
 
 #ifndef __APPLE__
 extern "C" void* INTERPOSE_FUNCTION_NAME(reallocarray)(void* pointer, size_t n,
                                                        size_t size) {
-    static auto* next = GET_REAL_FUNCTION(reallocarray);
-    processAllocation<false>(n * size);
-    return next(pointer, n, size);
+    Sample sample{};
+    const bool sampled = processReallocation(pointer, sample);
+    void* result = interpose::real::reallocarray(pointer, n, size);
+    processAllocation<false>(n * size, result, __builtin_frame_address(0));
+    if (sampled) {
+        processReallocated(sample, pointer, n * size, result);
+    }
+    return result;
 }
 INTERPOSE(reallocarray);
 #endif
@@ -176,16 +1117,17 @@ INTERPOSE(reallocarray);
 extern "C" int INTERPOSE_FUNCTION_NAME(posix_memalign)(void** memptr,
                                                        size_t alignment,
                                                        size_t size) {
-    static auto* next = GET_REAL_FUNCTION(posix_memalign);
-    processAllocation<true>(size);
-    return next(memptr, alignment, size);
+    const int result = interpose::real::posix_memalign(memptr, alignment, size);
+    processAllocation<true>(size, result == 0 ? *memptr : nullptr,
+                            __builtin_frame_address(0));
+    return result;
 }
 INTERPOSE(posix_memalign);
 
 extern "C" void* INTERPOSE_FUNCTION_NAME(aligned_alloc)(size_t alignment,
                                                         size_t size) {
-    static auto* next = GET_REAL_FUNCTION(aligned_alloc);
-    processAllocation<true>(size);
-    return next(alignment, size);
+    void* result = interpose::real::aligned_alloc(alignment, size);
+    processAllocation<true>(size, result, __builtin_frame_address(0));
+    return result;
 }
 INTERPOSE(aligned_alloc);
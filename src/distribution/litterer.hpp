@@ -2,25 +2,40 @@
 #define DISTRIBUTION_LITTERER_HPP
 
 #include <dlfcn.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/syscall.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <barrier>
+#include <bit>
 #include <cassert>
 #include <chrono>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <filesystem>
-#include <fstream>
+#include <functional>
 #include <iterator>
+#include <limits>
+#include <memory>
 #include <numeric>
+#include <optional>
 #include <random>
+#include <span>
 #include <string>
 #include <thread>
+#include <utility>
 #include <vector>
 
+#include "binary.hpp"
 #include "json.hpp"
+#include "occupancy.hpp"
 
 namespace distribution::litterer {
 
@@ -34,7 +49,7 @@ void assertOrExit(bool condition, std::FILE* log, const std::string& message) {
 }
 
 template <typename T, typename Generator>
-void partialShuffle(std::vector<T>& v, std::size_t n, Generator& g) {
+void partialShuffle(std::span<T> v, std::size_t n, Generator& g) {
     const auto m = std::min(n, v.size() - 2);
     for (std::size_t i = 0; i < m; ++i) {
         const auto j
@@ -49,9 +64,367 @@ cumulativeSum(const std::vector<std::uint64_t>& bins) {
     std::partial_sum(bins.begin(), bins.end(), cumsum.begin());
     return cumsum;
 }
+
+// xoshiro256** by David Blackman and Sebastiano Vigna, seeded with splitmix64.
+class Xoshiro256StarStar {
+  public:
+    using result_type = std::uint64_t;
+
+    explicit Xoshiro256StarStar(std::uint64_t seed) {
+        for (auto& word : state) {
+            seed += 0x9E3779B97F4A7C15;
+            std::uint64_t z = seed;
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EB;
+            word = z ^ (z >> 31);
+        }
+    }
+
+    static constexpr result_type min() {
+        return 0;
+    }
+
+    static constexpr result_type max() {
+        return std::numeric_limits<result_type>::max();
+    }
+
+    result_type operator()() {
+        const auto result = std::rotl(state[1] * 5, 7) * 9;
+        const auto t = state[1] << 17;
+        state[2] ^= state[0];
+        state[3] ^= state[1];
+        state[1] ^= state[2];
+        state[0] ^= state[3];
+        state[2] ^= t;
+        state[3] = std::rotl(state[3], 45);
+        return result;
+    }
+
+  private:
+    std::array<std::uint64_t, 4> state{};
+};
+
+// Walker's alias method, built with Vose's algorithm. Each draw takes a single
+// 64-bit random number: the high half picks a column, the low half decides
+// between the column and its alias.
+class AliasTable {
+  public:
+    explicit AliasTable(const std::vector<std::uint64_t>& weights)
+        : thresholds(weights.size()), aliases(weights.size()) {
+        assert(!weights.empty());
+        assert(weights.size() <= std::numeric_limits<std::uint32_t>::max());
+
+        const auto n = weights.size();
+        const auto total = static_cast<double>(
+            std::accumulate(weights.begin(), weights.end(), std::uint64_t(0)));
+
+        std::vector<double> scaled(n);
+        std::vector<std::uint32_t> small;
+        std::vector<std::uint32_t> large;
+        for (std::size_t i = 0; i < n; ++i) {
+            scaled[i] = static_cast<double>(weights[i])
+                        * static_cast<double>(n) / total;
+            (scaled[i] < 1.0 ? small : large)
+                .push_back(static_cast<std::uint32_t>(i));
+        }
+
+        while (!small.empty() && !large.empty()) {
+            const auto s = small.back();
+            small.pop_back();
+            const auto l = large.back();
+
+            thresholds[s] = toThreshold(scaled[s]);
+            aliases[s] = l;
+
+            scaled[l] -= 1.0 - scaled[s];
+            if (scaled[l] < 1.0) {
+                large.pop_back();
+                small.push_back(l);
+            }
+        }
+
+        // Leftovers are only due to rounding errors, and should be always
+        // picked.
+        for (const auto i : large) {
+            thresholds[i] = kAlways;
+            aliases[i] = i;
+        }
+        for (const auto i : small) {
+            thresholds[i] = kAlways;
+            aliases[i] = i;
+        }
+    }
+
+    template <typename Generator>
+    std::size_t operator()(Generator& generator) const {
+        static_assert(Generator::min() == 0
+                      && Generator::max()
+                             == std::numeric_limits<std::uint64_t>::max());
+        const std::uint64_t r = generator();
+        const auto column = static_cast<std::size_t>(
+            ((r >> 32) * thresholds.size()) >> 32);
+        return (r & 0xFFFFFFFF) < thresholds[column] ? column
+                                                     : aliases[column];
+    }
+
+  private:
+    static constexpr std::uint64_t kAlways = std::uint64_t(1) << 32;
+
+    static std::uint64_t toThreshold(double probability) {
+        const auto scaled = probability * static_cast<double>(kAlways);
+        return std::min(kAlways, static_cast<std::uint64_t>(scaled));
+    }
+
+    std::vector<std::uint64_t> thresholds;
+    std::vector<std::uint32_t> aliases;
+};
+
+// Draws lifetimes, in allocations, from the histograms written by the
+// detector: bucket 0 holds lifetimes of 0, and bucket k > 0 those in
+// [2^(k-1), 2^k). Objects which were still alive when the profiled program
+// exited never die. Size classes without any sampled object use the histogram
+// of all size classes together.
+class Lifetimes {
+  public:
+    static constexpr std::size_t kBuckets = binary::kLifetimeBuckets;
+    static constexpr std::uint64_t kNever
+        = std::numeric_limits<std::uint64_t>::max();
+
+    Lifetimes(std::span<const binary::LifetimeBin> lifetimes,
+              std::size_t nBins)
+        : perBin(nBins) {
+        std::vector<std::uint64_t> overall(kBuckets + 1);
+        for (const auto& entry : lifetimes) {
+            const auto bin = entry.bin;
+            std::vector<std::uint64_t> weights(entry.allocations.begin(),
+                                               entry.allocations.end());
+            weights.push_back(entry.survivors);
+
+            std::transform(overall.begin(), overall.end(), weights.begin(),
+                           overall.begin(), std::plus<>());
+            if (bin < nBins && hasWeight(weights)) {
+                perBin[bin].emplace(weights);
+            }
+        }
+
+        assert(hasWeight(overall));
+        fallback.emplace(overall);
+    }
+
+    template <typename Generator>
+    std::uint64_t operator()(std::size_t bin, Generator& generator) const {
+        const auto bucket
+            = perBin[bin] ? (*perBin[bin])(generator) : (*fallback)(generator);
+        if (bucket == kBuckets) {
+            return kNever;
+        }
+        if (bucket == 0) {
+            return 0;
+        }
+        const auto low = std::uint64_t(1) << (bucket - 1);
+        return low + (generator() & (low - 1));
+    }
+
+    // Whether the distribution has any lifetime to draw from.
+    static bool available(std::span<const binary::LifetimeBin> lifetimes) {
+        return std::any_of(lifetimes.begin(), lifetimes.end(),
+                           [](const binary::LifetimeBin& entry) {
+                               return entry.survivors != 0
+                                      || hasWeight(entry.allocations);
+                           });
+    }
+
+  private:
+    static bool hasWeight(std::span<const std::uint64_t> weights) {
+        return std::any_of(weights.begin(), weights.end(),
+                           [](std::uint64_t weight) { return weight != 0; });
+    }
+
+    std::vector<std::optional<AliasTable>> perBin;
+    std::optional<AliasTable> fallback;
+};
+
+// Maps a distribution file in memory. Binary distributions are used from the
+// mapping as they are, JSON ones are converted first.
+class DistributionFile {
+  public:
+    DistributionFile(const std::string& filename, std::FILE* log) {
+        const int fd = open(filename.c_str(), O_RDONLY);
+        struct stat status {};
+        assertOrExit(fd != -1 && fstat(fd, &status) == 0, log,
+                     "Could not open " + filename + ".");
+
+        mappingSize = static_cast<std::size_t>(status.st_size);
+        if (mappingSize != 0) {
+            mapping = mmap(nullptr, mappingSize, PROT_READ, MAP_PRIVATE, fd, 0);
+            assertOrExit(mapping != MAP_FAILED, log,
+                         "Could not map " + filename + ".");
+        }
+        close(fd);
+
+        std::span<const char> data(static_cast<const char*>(mapping),
+                                   mappingSize);
+        if (!binary::isBinary(data)) {
+            converted = binary::fromJson(
+                nlohmann::json::parse(data.begin(), data.end()));
+            munmap(mapping, mappingSize);
+            mapping = nullptr;
+            data = converted;
+        }
+
+        std::string error;
+        view = binary::View::parse(data, error);
+        assertOrExit(view.has_value(), log, filename + ": " + error + ".");
+    }
+
+    ~DistributionFile() {
+        if (mapping != nullptr) {
+            munmap(mapping, mappingSize);
+        }
+    }
+
+    DistributionFile(const DistributionFile&) = delete;
+    DistributionFile& operator=(const DistributionFile&) = delete;
+    DistributionFile(DistributionFile&&) = delete;
+    DistributionFile& operator=(DistributionFile&&) = delete;
+
+    [[nodiscard]] const binary::View& get() const {
+        return *view;
+    }
+
+  private:
+    void* mapping = nullptr;
+    std::size_t mappingSize = 0;
+    // The binary encoding of a JSON distribution.
+    std::string converted;
+    std::optional<binary::View> view;
+};
+
+// Moves the objects dying before end to the front, in order of death, and
+// returns how many they are.
+template <typename T>
+std::size_t orderByDeath(std::span<T> objects,
+                         std::span<const std::uint64_t> deaths,
+                         std::uint64_t end) {
+    std::vector<std::size_t> order(objects.size());
+    std::iota(order.begin(), order.end(), std::size_t(0));
+    const auto survivors
+        = std::partition(order.begin(), order.end(),
+                         [&](std::size_t i) { return deaths[i] < end; });
+    std::sort(order.begin(), survivors, [&](std::size_t a, std::size_t b) {
+        return deaths[a] < deaths[b];
+    });
+
+    std::vector<T> reordered;
+    reordered.reserve(objects.size());
+    for (const auto i : order) {
+        reordered.push_back(objects[i]);
+    }
+    std::copy(reordered.begin(), reordered.end(), objects.begin());
+    return std::distance(order.begin(), survivors);
+}
+
+// Keeps littering in a background thread for the lifetime of the process:
+// at the given rate, frees a random litter object once there are target of
+// them, and allocates a new one from the distribution.
+class Churn {
+  public:
+    Churn(std::vector<void*> objects, std::size_t target, double rate,
+          std::vector<std::size_t> sizeClasses,
+          const std::vector<std::uint64_t>& bins, std::uint64_t seed)
+        : objects(std::move(objects)), target(target), rate(rate),
+          sizeClasses(std::move(sizeClasses)), aliasTable(bins),
+          generator(seed) {
+        this->objects.reserve(std::max(target, this->objects.size()));
+        thread = std::thread([this]() { run(); });
+    }
+
+    ~Churn() {
+        stop();
+    }
+
+    Churn(const Churn&) = delete;
+    Churn& operator=(const Churn&) = delete;
+    Churn(Churn&&) = delete;
+    Churn& operator=(Churn&&) = delete;
+
+    void stop() {
+        stopping = true;
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+
+    // Only meaningful once stopped.
+    [[nodiscard]] std::uint64_t getAllocations() const {
+        return allocations;
+    }
+
+    [[nodiscard]] std::uint64_t getFrees() const {
+        return frees;
+    }
+
+    [[nodiscard]] std::chrono::nanoseconds getCpuTime() const {
+        return cpuTime;
+    }
+
+  private:
+    static constexpr auto kInterval = std::chrono::milliseconds(1);
+
+    void run() {
+        const auto start = std::chrono::steady_clock::now();
+        while (!stopping) {
+            // Catch up with the operations owed since the start, so that
+            // oversleeping does not lower the rate.
+            const std::chrono::duration<double> elapsed
+                = std::chrono::steady_clock::now() - start;
+            const auto owed
+                = static_cast<std::uint64_t>(elapsed.count() * rate);
+            while (allocations < owed && !stopping) {
+                step();
+            }
+            std::this_thread::sleep_for(kInterval);
+        }
+
+        timespec time{};
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+        cpuTime = std::chrono::seconds(time.tv_sec)
+                  + std::chrono::nanoseconds(time.tv_nsec);
+    }
+
+    void step() {
+        if (!objects.empty() && objects.size() >= target) {
+            const auto i = std::uniform_int_distribution<std::size_t>(
+                0, objects.size() - 1)(generator);
+            std::free(objects[i]);
+            objects[i] = objects.back();
+            objects.pop_back();
+            ++frees;
+        }
+
+        void* object = std::malloc(sizeClasses[aliasTable(generator)]);
+        if (object != nullptr) {
+            objects.push_back(object);
+        }
+        ++allocations;
+    }
+
+    std::vector<void*> objects;
+    std::size_t target;
+    double rate;
+    std::vector<std::size_t> sizeClasses;
+    AliasTable aliasTable;
+    Xoshiro256StarStar generator;
+    std::atomic_bool stopping = false;
+    std::uint64_t allocations = 0;
+    std::uint64_t frees = 0;
+    std::chrono::nanoseconds cpuTime{0};
+    std::thread thread;
+};
 } // namespace detail
 
-void runLitterer() {
+// Returns the churn thread, when continuous littering is enabled.
+[[nodiscard]] std::unique_ptr<detail::Churn> runLitterer() {
     std::FILE* log = stderr;
     if (const char* env = std::getenv("LITTER_LOG_FILENAME")) {
         log = std::fopen(env, "a");
@@ -63,7 +436,24 @@ void runLitterer() {
     if (const char* env = std::getenv("LITTER_SEED")) {
         seed = std::atoi(env);
     }
-    auto generator = std::mt19937_64(seed);
+
+    std::string generatorName = "mt19937_64";
+    if (const char* env = std::getenv("LITTER_GENERATOR")) {
+        generatorName = env;
+        detail::assertOrExit(generatorName == "mt19937_64"
+                                 || generatorName == "xoshiro256**",
+                             log,
+                             "Generator must be mt19937_64 or xoshiro256**.");
+    }
+
+    // Binary search stays the default, so that a given LITTER_SEED draws the
+    // same litter as before; alias tables draw other sizes from the same seed.
+    std::string sampler = "binary-search";
+    if (const char* env = std::getenv("LITTER_SAMPLER")) {
+        sampler = env;
+        detail::assertOrExit(sampler == "alias" || sampler == "binary-search",
+                             log, "Sampler must be alias or binary-search.");
+    }
 
     double occupancy = 0.95;
     if (const char* env = std::getenv("LITTER_OCCUPANCY")) {
@@ -85,6 +475,64 @@ void runLitterer() {
     detail::assertOrExit(!(shuffle && sort), log,
                          "Select either shuffle or sort, not both.");
 
+    // Instead of a fraction of objects, free objects until the live litter
+    // objects fill this fraction of the blocks of 2^LITTER_BLOCK_OCCUPANCY_BITS
+    // bytes they touch, as reported by the fragmentation tool: the lower, the
+    // more fragmented the heap.
+    std::optional<double> targetBlockOccupancy;
+    if (const char* env = std::getenv("LITTER_BLOCK_OCCUPANCY")) {
+        targetBlockOccupancy = std::atof(env);
+        detail::assertOrExit(*targetBlockOccupancy > 0
+                                 && *targetBlockOccupancy <= 1,
+                             log, "Block occupancy must be in (0, 1].");
+    }
+
+    std::uint8_t blockOccupancyBits = 12;
+    if (const char* env = std::getenv("LITTER_BLOCK_OCCUPANCY_BITS")) {
+        const int value = std::atoi(env);
+        detail::assertOrExit(value >= 0 && value < 64, log,
+                             "Block occupancy bits must be in [0, 64).");
+        blockOccupancyBits = value;
+    }
+
+    // Instead of a fraction of objects, free the objects whose lifetime, drawn
+    // from the lifetimes in the distribution, has ended by the end of
+    // littering. LITTER_OCCUPANCY is then ignored.
+    bool useLifetimes = false;
+    if (const char* env = std::getenv("LITTER_LIFETIMES")) {
+        useLifetimes = std::atoi(env) != 0;
+    }
+
+    // Continuous littering, in allocations per second, 0 to disable it.
+    double churnRate = 0;
+    if (const char* env = std::getenv("LITTER_CHURN_RATE")) {
+        churnRate = std::atof(env);
+        detail::assertOrExit(churnRate >= 0, log,
+                             "Churn rate must not be negative.");
+    }
+
+    // By default, churning keeps as many litter objects alive as littering
+    // left.
+    std::optional<double> churnOccupancy;
+    if (const char* env = std::getenv("LITTER_CHURN_OCCUPANCY")) {
+        churnOccupancy = std::atof(env);
+        detail::assertOrExit(*churnOccupancy >= 0 && *churnOccupancy <= 1, log,
+                             "Churn occupancy must be between 0 and 1.");
+    }
+
+    std::size_t nThreads = 1;
+    if (const char* env = std::getenv("LITTER_THREADS")) {
+        const int value = std::atoi(env);
+        detail::assertOrExit(value >= 1, log,
+                             "Number of threads must be at least 1.");
+        nThreads = value;
+    }
+
+    bool parkThreads = false;
+    if (const char* env = std::getenv("LITTER_PARK_THREADS")) {
+        parkThreads = std::atoi(env) != 0;
+    }
+
     std::uint32_t sleepDelay = 0;
     if (const char* env = std::getenv("LITTER_SLEEP")) {
         sleepDelay = std::atoi(env);
@@ -103,77 +551,302 @@ void runLitterer() {
     detail::assertOrExit(std::filesystem::exists(dataFilename), log,
                          dataFilename + " does not exist.");
 
-    std::ifstream inputFile(dataFilename);
-    nlohmann::json data; // NOLINT(misc-include-cleaner)
-    inputFile >> data;
+    const detail::DistributionFile file(dataFilename, log);
+    const auto& data = file.get();
 
     Dl_info mallocInfo;
     const int status = dladdr(reinterpret_cast<void*>(&malloc), &mallocInfo);
     detail::assertOrExit(status != 0, log, "Could not get malloc info.");
     const auto mallocSourceObject = std::string(mallocInfo.dli_fname);
 
-    const auto sizeClasses
-        = data["sizeClasses"].get<std::vector<std::size_t>>();
-    const auto bins = data["bins"].get<std::vector<std::uint64_t>>();
-    const auto maxLiveAllocations
-        = data["maxLiveAllocations"].get<std::int64_t>();
+    const std::vector<std::size_t> sizeClasses(data.sizeClasses().begin(),
+                                               data.sizeClasses().end());
+    const std::vector<std::uint64_t> bins(data.bins().begin(),
+                                          data.bins().end());
+    const auto maxLiveAllocations = data.getHeader().maxLiveAllocations;
     const auto nAllocations
         = std::accumulate(bins.begin(), bins.end(), std::uint64_t(0));
     const std::size_t nAllocationsLitter = maxLiveAllocations * multiplier;
 
+    detail::assertOrExit(!useLifetimes
+                             || detail::Lifetimes::available(data.lifetimes()),
+                         log, dataFilename + " has no lifetimes.");
+    detail::assertOrExit(
+        !useLifetimes || !targetBlockOccupancy, log,
+        "Select either lifetimes or a block occupancy, not both.");
+    std::optional<detail::Lifetimes> lifetimes;
+    if (useLifetimes) {
+        lifetimes.emplace(data.lifetimes(), bins.size());
+    }
+
     std::fprintf(log, "==================================== Litterer "
                       "====================================\n");
     std::fprintf(log, "malloc     : %s\n", mallocSourceObject.c_str());
     std::fprintf(log, "seed       : %u\n", seed);
-    std::fprintf(log, "occupancy  : %f\n", occupancy);
+    std::fprintf(log, "generator  : %s\n", generatorName.c_str());
+    std::fprintf(log, "sampler    : %s\n", sampler.c_str());
+    if (lifetimes) {
+        std::fprintf(log, "occupancy  : from lifetimes\n");
+    } else if (targetBlockOccupancy) {
+        std::fprintf(log, "occupancy  : %f of blocks (2^%u B)\n",
+                     *targetBlockOccupancy,
+                     static_cast<unsigned>(blockOccupancyBits));
+    } else {
+        std::fprintf(log, "occupancy  : %f\n", occupancy);
+    }
     std::fprintf(log, "shuffle    : %s\n", shuffle ? "yes" : "no");
     std::fprintf(log, "sort       : %s\n", sort ? "yes" : "no");
+    std::fprintf(log, "threads    : %zu%s\n", nThreads,
+                 parkThreads && nThreads > 1 ? " (parked)" : "");
     std::fprintf(log, "sleep      : %s\n",
                  sleepDelay != 0 ? std::to_string(sleepDelay).c_str() : "no");
     std::fprintf(log, "litter     : %u * %lld = %zu\n", multiplier,
                  static_cast<long long>(maxLiveAllocations),
                  nAllocationsLitter);
+    if (churnRate != 0) {
+        std::fprintf(log, "churn      : %.0f allocation(s)/s\n", churnRate);
+    } else {
+        std::fprintf(log, "churn      : no\n");
+    }
     std::fprintf(log, "========================================================"
                       "==========================\n");
 
-    const std::vector<std::uint64_t> binsCumSum = detail::cumulativeSum(bins);
+    std::vector<std::uint64_t> binsCumSum;
+    std::optional<detail::AliasTable> aliasTable;
+    if (sampler == "alias") {
+        aliasTable.emplace(bins);
+    } else {
+        binsCumSum = detail::cumulativeSum(bins);
+    }
 
     const auto start = std::chrono::high_resolution_clock::now();
+    auto allocated = start;
 
-    std::uniform_int_distribution<std::uint64_t> distribution(1, nAllocations);
     std::vector<void*> objects(nAllocationsLitter);
-
-    for (std::size_t i = 0; i < nAllocationsLitter; ++i) {
-        const auto offset = distribution(generator);
-        const auto it
-            = std::lower_bound(binsCumSum.begin(), binsCumSum.end(), offset);
-        const auto bin = std::distance(binsCumSum.begin(), it);
-        objects[i] = std::malloc(sizeClasses.at(bin));
-        detail::assertOrExit(objects[i] != nullptr, log, "malloc failed.");
-    }
-
     const auto nObjectsToBeFreed = static_cast<std::size_t>(
         (1 - occupancy) * static_cast<double>(nAllocationsLitter));
 
-    if (shuffle) {
+    // When freeing by lifetime, the death of each object, in allocations since
+    // littering started.
+    std::vector<std::uint64_t> deaths(lifetimes ? nAllocationsLitter : 0);
+    std::atomic_size_t nObjectsFreedByLifetime = 0;
+    std::vector<std::size_t> nObjectsFreed(nThreads);
+    // When freeing to a block occupancy, the one reached by each thread.
+    std::vector<double> blockOccupancies(nThreads);
+
+    if (lifetimes) {
+        std::fprintf(log, "Freeing objects in order of death.\n");
+    } else if (targetBlockOccupancy) {
+        std::fprintf(log, "Freeing objects until a block occupancy of %f.\n",
+                     *targetBlockOccupancy);
+    } else if (shuffle) {
         std::fprintf(log, "Shuffling %zu object(s) to be freed.\n",
                      nObjectsToBeFreed);
-        detail::partialShuffle(objects, nObjectsToBeFreed, generator);
     } else if (sort) {
         std::fprintf(log, "Sorting all %zu objects.\n", objects.size());
-        std::sort(objects.begin(), objects.end(), std::greater<>());
     }
 
-    for (std::size_t i = 0; i < nObjectsToBeFreed; ++i) {
-        std::free(objects[i]);
+    // Each thread allocates, then frees, its own slice of the objects, so that
+    // both happen in that thread's cache or arena. Parked threads are detached
+    // while they may still be leaving the last barrier, so they share its
+    // ownership rather than use one on this stack.
+    const auto barrier = std::make_shared<std::barrier<>>(
+        static_cast<std::ptrdiff_t>(nThreads));
+    const auto litterSlice = [&](std::size_t thread, std::barrier<>& sync,
+                                 auto generator) {
+        const auto begin = nAllocationsLitter * thread / nThreads;
+        const auto end = nAllocationsLitter * (thread + 1) / nThreads;
+        const auto slice = std::span(objects).subspan(begin, end - begin);
+        auto nSliceObjectsToBeFreed = static_cast<std::size_t>(
+            (1 - occupancy) * static_cast<double>(slice.size()));
+        // When freeing to a block occupancy, each object of the slice with its
+        // size, reordered along with it. Sizes are not looked up by address,
+        // which would take a heap node per object.
+        std::vector<std::pair<void*, std::size_t>> sizedSlice;
+        if (targetBlockOccupancy) {
+            // Any object may have to be freed.
+            nSliceObjectsToBeFreed = slice.size();
+            sizedSlice.resize(slice.size());
+        }
+
+        std::uniform_int_distribution<std::uint64_t> distribution(
+            1, nAllocations);
+        for (auto& object : slice) {
+            std::size_t bin = 0;
+            if (aliasTable) {
+                bin = (*aliasTable)(generator);
+            } else {
+                const auto offset = distribution(generator);
+                const auto it = std::lower_bound(binsCumSum.begin(),
+                                                 binsCumSum.end(), offset);
+                bin = std::distance(binsCumSum.begin(), it);
+            }
+            object = std::malloc(sizeClasses[bin]);
+            detail::assertOrExit(object != nullptr, log, "malloc failed.");
+            if (targetBlockOccupancy) {
+                sizedSlice[&object - &slice[0]] = {object, sizeClasses[bin]};
+            }
+
+            // Threads allocate side by side, so the i-th object of a slice is
+            // allocated around time i * nThreads.
+            if (lifetimes) {
+                const auto i = static_cast<std::uint64_t>(&object - &slice[0]);
+                const auto lifetime = (*lifetimes)(bin, generator);
+                deaths[begin + i]
+                    = lifetime == detail::Lifetimes::kNever
+                          ? lifetime
+                          : (i * nThreads) + lifetime;
+            }
+        }
+
+        const auto reorder = [&](auto toBeReordered) {
+            if (shuffle) {
+                detail::partialShuffle(toBeReordered, nSliceObjectsToBeFreed,
+                                       generator);
+            } else if (sort) {
+                std::sort(toBeReordered.begin(), toBeReordered.end(),
+                          std::greater<>());
+            }
+        };
+
+        if (lifetimes) {
+            nSliceObjectsToBeFreed = detail::orderByDeath(
+                slice,
+                std::span<const std::uint64_t>(deaths).subspan(begin,
+                                                               slice.size()),
+                nAllocationsLitter);
+            nObjectsFreedByLifetime += nSliceObjectsToBeFreed;
+        } else if (targetBlockOccupancy) {
+            reorder(std::span(sizedSlice));
+            for (std::size_t i = 0; i < slice.size(); ++i) {
+                slice[i] = sizedSlice[i].first;
+            }
+        } else {
+            reorder(slice);
+        }
+
+        // Each thread only measures its own slice: with per-thread caches or
+        // arenas, slices mostly live in separate blocks.
+        std::optional<Occupancy> blocks;
+        if (targetBlockOccupancy) {
+            blocks.emplace(blockOccupancyBits);
+            for (const auto& [object, size] : sizedSlice) {
+                blocks->add(reinterpret_cast<std::uintptr_t>(object), size);
+            }
+        }
+
+        sync.arrive_and_wait();
+        if (thread == 0) {
+            allocated = std::chrono::high_resolution_clock::now();
+        }
+
+        std::size_t nSliceObjectsFreed = 0;
+        for (; nSliceObjectsFreed < nSliceObjectsToBeFreed;
+             ++nSliceObjectsFreed) {
+            auto* object = slice[nSliceObjectsFreed];
+            if (blocks) {
+                if (blocks->occupation() <= *targetBlockOccupancy) {
+                    break;
+                }
+                blocks->remove(reinterpret_cast<std::uintptr_t>(object),
+                               sizedSlice[nSliceObjectsFreed].second);
+            }
+            std::free(object);
+        }
+        nObjectsFreed[thread] = nSliceObjectsFreed;
+        if (blocks) {
+            blockOccupancies[thread] = blocks->occupation();
+        }
+
+        sync.arrive_and_wait();
+    };
+
+    const auto runThread = [&](std::size_t thread, std::barrier<>& sync) {
+        if (generatorName == "xoshiro256**") {
+            litterSlice(thread, sync,
+                        detail::Xoshiro256StarStar(seed + thread));
+        } else {
+            litterSlice(thread, sync, std::mt19937_64(seed + thread));
+        }
+    };
+
+    std::vector<std::thread> threads;
+    threads.reserve(nThreads - 1);
+    for (std::size_t thread = 1; thread < nThreads; ++thread) {
+        threads.emplace_back([&runThread, parkThreads, thread, barrier]() {
+            runThread(thread, *barrier);
+            // Keep the thread, and thus its heap, alive until exit.
+            while (parkThreads) {
+                pause();
+            }
+        });
+    }
+    runThread(0, *barrier);
+    for (auto& thread : threads) {
+        if (parkThreads) {
+            thread.detach();
+        } else {
+            thread.join();
+        }
     }
 
     const auto end = std::chrono::high_resolution_clock::now();
-    const auto elapsed_s
-        = std::chrono::duration_cast<std::chrono::seconds>((end - start))
-              .count();
-    std::fprintf(log, "Finished littering. Time taken: %lld seconds.\n",
-                 static_cast<long long>(elapsed_s));
+    if (lifetimes) {
+        std::fprintf(log, "Freed %zu object(s) whose lifetime ended.\n",
+                     nObjectsFreedByLifetime.load());
+    }
+    if (targetBlockOccupancy) {
+        std::fprintf(log,
+                     "Freed %zu object(s), reaching a block occupancy of %f.\n",
+                     std::accumulate(nObjectsFreed.begin(), nObjectsFreed.end(),
+                                     std::size_t(0)),
+                     std::accumulate(blockOccupancies.begin(),
+                                     blockOccupancies.end(), 0.0)
+                         / static_cast<double>(nThreads));
+        if (std::any_of(blockOccupancies.begin(), blockOccupancies.end(),
+                        [&](double reached) {
+                            return reached > *targetBlockOccupancy;
+                        })) {
+            std::fprintf(log, "Warning: the target block occupancy was not "
+                              "reached, even freeing every object.\n");
+        }
+    }
+
+    const auto toMilliseconds = [](auto duration) {
+        return static_cast<long long>(
+            std::chrono::duration_cast<std::chrono::milliseconds>(duration)
+                .count());
+    };
+    std::fprintf(log,
+                 "Finished littering. Time taken: %lld ms (allocating: %lld "
+                 "ms, freeing: %lld ms).\n",
+                 toMilliseconds(end - start), toMilliseconds(allocated - start),
+                 toMilliseconds(end - allocated));
+
+    std::unique_ptr<detail::Churn> churn;
+    if (churnRate != 0) {
+        std::vector<void*> survivors;
+        for (std::size_t thread = 0; thread < nThreads; ++thread) {
+            const auto begin = nAllocationsLitter * thread / nThreads;
+            const auto end = nAllocationsLitter * (thread + 1) / nThreads;
+            const auto slice = std::span(objects).subspan(begin, end - begin);
+            survivors.insert(survivors.end(),
+                             slice.begin()
+                                 + static_cast<std::ptrdiff_t>(
+                                     nObjectsFreed[thread]),
+                             slice.end());
+        }
+
+        auto target = survivors.size();
+        if (churnOccupancy) {
+            target = static_cast<std::size_t>(
+                *churnOccupancy * static_cast<double>(nAllocationsLitter));
+        }
+        std::fprintf(log, "Churning with %zu live object(s).\n", target);
+        churn = std::make_unique<detail::Churn>(std::move(survivors), target,
+                                                churnRate, sizeClasses, bins,
+                                                seed + nThreads);
+    }
 
     if (sleepDelay != 0) {
         std::fprintf(log, "Sleeping %u seconds before resuming... (PID: %u)\n",
@@ -192,22 +865,28 @@ void runLitterer() {
     // A marker syscall to inform any instrumentation that littering is done.
     syscall(SYS_getpid);
 #endif
+
+    return churn;
 }
 
 struct Helper {
     Helper() {
-        distribution::litterer::runLitterer();
+        churn = distribution::litterer::runLitterer();
         start = std::chrono::high_resolution_clock::now();
     }
 
     ~Helper() {
+        const auto end = std::chrono::high_resolution_clock::now();
+        if (churn != nullptr) {
+            churn->stop();
+        }
+
         std::FILE* log = stderr;
         if (const char* env = std::getenv("LITTER_LOG_FILENAME")) {
             log = std::fopen(env, "a");
             assert(log != nullptr);
         }
 
-        const auto end = std::chrono::high_resolution_clock::now();
         const auto elapsed_ms
             = std::chrono::duration_cast<std::chrono::milliseconds>(
                   (end - start))
@@ -215,6 +894,23 @@ struct Helper {
         std::fprintf(log,
                      "========================================================"
                      "==========================\n");
+        if (churn != nullptr) {
+            const auto cpu_ms
+                = std::chrono::duration_cast<std::chrono::milliseconds>(
+                      churn->getCpuTime())
+                      .count();
+            const double share
+                = elapsed_ms == 0 ? 0
+                                  : 100.0 * static_cast<double>(cpu_ms)
+                                        / static_cast<double>(elapsed_ms);
+            std::fprintf(
+                log,
+                "Churn: %llu allocation(s), %llu free(s), CPU time %lld ms "
+                "(%.1f%% of elapsed)\n",
+                static_cast<unsigned long long>(churn->getAllocations()),
+                static_cast<unsigned long long>(churn->getFrees()),
+                static_cast<long long>(cpu_ms), share);
+        }
         std::fprintf(log, "Time elapsed: %lld ms\n",
                      static_cast<long long>(elapsed_ms));
         std::fprintf(log,
@@ -232,6 +928,7 @@ struct Helper {
     Helper& operator=(Helper&&) = delete;
 
   private:
+    std::unique_ptr<detail::Churn> churn;
     std::chrono::high_resolution_clock::time_point start;
 };
 } // namespace distribution::litterer
@@ -0,0 +1,77 @@
+#include <cstdlib>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <argparse/argparse.hpp>
+#include <nlohmann/json.hpp> // NOLINT(misc-include-cleaner)
+
+#include "merge.hpp"
+
+// Merges distributions recorded by several processes into one, following the
+// rules in merge.hpp.
+int main(int argc, char** argv) {
+    auto program = argparse::ArgumentParser("merge_distributions", "",
+                                            argparse::default_arguments::help);
+    program.add_argument("-i", "--input")
+        .help("input files, generated by the detector")
+        .required()
+        .nargs(argparse::nargs_pattern::at_least_one)
+        .metavar("FILE");
+    program.add_argument("-o", "--output")
+        .help("output file")
+        .default_value("distribution.json")
+        .metavar("FILE");
+    program.add_argument("--concurrent")
+        .help("the processes ran at the same time: sum their maximum live "
+              "allocations instead of keeping the largest")
+        .default_value(false)
+        .implicit_value(true);
+
+    try {
+        program.parse_args(argc, argv);
+    } catch (const std::exception& err) {
+        std::cerr << err.what() << std::endl;
+        std::cerr << program;
+        std::exit(EXIT_FAILURE);
+    }
+
+    const auto inputs = program.get<std::vector<std::string>>("--input");
+    const auto output = program.get<std::string>("--output");
+    const auto mode = program.get<bool>("--concurrent")
+                          ? distribution::merge::Mode::Concurrent
+                          : distribution::merge::Mode::Sequential;
+
+    nlohmann::json merged; // NOLINT(misc-include-cleaner)
+    for (const auto& input : inputs) {
+        std::ifstream inputFile(input);
+        if (!inputFile) {
+            std::cerr << "Failed to open " << input << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+
+        nlohmann::json data; // NOLINT(misc-include-cleaner)
+        try {
+            inputFile >> data;
+        } catch (const std::exception& err) {
+            std::cerr << input << ": " << err.what() << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+
+        if (merged.is_null()) {
+            merged = std::move(data);
+            continue;
+        }
+        std::string error;
+        if (!distribution::merge::merge(merged, data, mode, error)) {
+            std::cerr << input << ": " << error << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+    }
+
+    std::ofstream outputFile(output);
+    outputFile << merged.dump(4) << std::endl;
+}
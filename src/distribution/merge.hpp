@@ -0,0 +1,118 @@
+#ifndef DISTRIBUTION_MERGE_HPP
+#define DISTRIBUTION_MERGE_HPP
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <nlohmann/json.hpp> // NOLINT(misc-include-cleaner)
+
+// Merging of distributions recorded by several processes, or several runs:
+//   - size classes must be the same,
+//   - bins, ignored allocations, and lifetime histograms and survivors, which
+//     count allocations, are summed,
+//   - maxLiveAllocations (and its error bound, if any) is the largest one for
+//     processes which ran one after another (Sequential), and the sum for
+//     processes which ran at the same time (Concurrent), where the peaks may
+//     have coincided,
+//   - sample rates are the largest ones: sampled counts are already scaled up,
+//     so they add up with exact ones, and the result is only as precise as the
+//     most sampled input.
+
+namespace distribution::merge {
+enum class Mode : std::uint8_t { Sequential, Concurrent };
+
+namespace detail {
+inline void addVectors(nlohmann::json& into, const nlohmann::json& from) {
+    auto total = into.get<std::vector<std::uint64_t>>();
+    const auto other = from.get<std::vector<std::uint64_t>>();
+    total.resize(std::max(total.size(), other.size()));
+    for (std::size_t i = 0; i < other.size(); ++i) {
+        total[i] += other[i];
+    }
+    into = total;
+}
+
+inline void maxField(nlohmann::json& into, const nlohmann::json& from,
+                     const char* key) {
+    if (!from.contains(key)) {
+        return;
+    }
+    if (!into.contains(key)) {
+        into[key] = from[key];
+        return;
+    }
+    into[key] = std::max(into[key].get<std::uint64_t>(),
+                         from[key].get<std::uint64_t>());
+}
+
+inline void mergeLifetimes(nlohmann::json& into, const nlohmann::json& from) {
+    maxField(into, from, "sampleRate");
+
+    std::map<std::uint64_t, nlohmann::json> bins;
+    for (const auto* lifetimes :
+         std::array<const nlohmann::json*, 2>{&into, &from}) {
+        for (const auto& entry : (*lifetimes)["bins"]) {
+            const auto bin = entry["bin"].get<std::uint64_t>();
+            const auto it = bins.find(bin);
+            if (it == bins.end()) {
+                bins.emplace(bin, entry);
+                continue;
+            }
+            addVectors(it->second["allocations"], entry["allocations"]);
+            addVectors(it->second["nanoseconds"], entry["nanoseconds"]);
+            it->second["survivors"]
+                = it->second["survivors"].get<std::uint64_t>()
+                  + entry["survivors"].get<std::uint64_t>();
+        }
+    }
+
+    auto merged = nlohmann::json::array();
+    for (auto& [bin, entry] : bins) {
+        merged.push_back(std::move(entry));
+    }
+    into["bins"] = std::move(merged);
+}
+} // namespace detail
+
+// Merges from into into. Returns false, and sets error, if the distributions
+// cannot be merged, in which case into is left as it was.
+inline bool merge(nlohmann::json& into, const nlohmann::json& from, Mode mode,
+                  std::string& error) {
+    if (into["sizeClasses"] != from["sizeClasses"]) {
+        error = "distributions have different size classes";
+        return false;
+    }
+
+    detail::addVectors(into["bins"], from["bins"]);
+    into["ignored"] = into.value("ignored", std::uint64_t(0))
+                      + from.value("ignored", std::uint64_t(0));
+
+    for (const auto* key : {"maxLiveAllocations", "maxLiveAllocationsError"}) {
+        if (!from.contains(key)) {
+            continue;
+        }
+        const auto ours = into.value(key, std::int64_t(0));
+        const auto theirs = from[key].get<std::int64_t>();
+        into[key] = mode == Mode::Concurrent ? ours + theirs
+                                             : std::max(ours, theirs);
+    }
+
+    detail::maxField(into, from, "sampleRate");
+
+    if (from.contains("lifetimes")) {
+        if (into.contains("lifetimes")) {
+            detail::mergeLifetimes(into["lifetimes"], from["lifetimes"]);
+        } else {
+            into["lifetimes"] = from["lifetimes"];
+        }
+    }
+    return true;
+}
+} // namespace distribution::merge
+
+#endif // DISTRIBUTION_MERGE_HPP
@@ -3,7 +3,6 @@
 #include <cstdint>
 #include <cstdlib>
 #include <exception>
-#include <fstream>
 #include <ios>
 #include <iostream>
 #include <vector>
@@ -11,6 +10,7 @@
 #include <argparse/argparse.hpp>
 
 #include "shared.hpp"
+#include "trace.hpp"
 
 namespace {
 bool closeEnough(std::uint64_t a, std::uint64_t b, std::uint64_t distance) {
@@ -19,6 +19,9 @@ bool closeEnough(std::uint64_t a, std::uint64_t b, std::uint64_t distance) {
 } // namespace
 
 int main(int argc, char** argv) {
+    // Must precede any I/O. Output is only flushed at exit.
+    std::ios::sync_with_stdio(false);
+
     auto program = argparse::ArgumentParser("benchmark_iterator", "",
                                             argparse::default_arguments::help);
     program.add_argument("-i", "--input")
@@ -55,11 +58,7 @@ int main(int argc, char** argv) {
     const auto epsilon = program.get<std::uint64_t>("--epsilon");
     const auto maxSize = program.get<std::uint64_t>("--max-size");
 
-    std::ifstream input_file(input, std::ios::binary);
-    if (!input_file) {
-        std::cerr << "Failed to open " << input << std::endl;
-        std::exit(EXIT_FAILURE);
-    }
+    trace::Reader reader(input);
 
     std::vector<bool> buffer(bufferSize);
     std::size_t index = 0;
@@ -69,7 +68,7 @@ int main(int argc, char** argv) {
     // Initial fill.
     Event event;
     for (;;) {
-        if (!input_file.read(reinterpret_cast<char*>(&event), sizeof(event))) {
+        if (!reader.next(event)) {
             std::cerr << "Not enough data in input file." << std::endl;
             std::exit(EXIT_FAILURE);
         }
@@ -93,7 +92,7 @@ int main(int argc, char** argv) {
         }
     }
 
-    while (input_file.read(reinterpret_cast<char*>(&event), sizeof(event))) {
+    while (reader.next(event)) {
         if (event.type == EventType::Allocation
             || event.type == EventType::Reallocation) {
 
@@ -113,7 +112,7 @@ int main(int argc, char** argv) {
             std::cout << event.timestamp_ns << ","
                       << static_cast<double>(count)
                              / static_cast<double>(bufferSize)
-                      << std::endl;
+                      << '\n';
         }
     }
 }
@@ -2,44 +2,34 @@
 #include <cstdint>
 #include <cstdlib>
 #include <exception>
-#include <fstream>
 #include <ios>
 #include <iostream>
+#include <string>
 #include <unordered_map>
-#include <unordered_set>
+#include <vector>
 
 #include <argparse/argparse.hpp>
 
+#include "occupancy.hpp"
 #include "shared.hpp"
+#include "trace.hpp"
 
 namespace {
-double occupation(
-    const std::unordered_map<std::uint64_t, std::uint64_t>& sizeByPointer,
-    std::uint8_t ignored_bits) {
-    const auto ignored_size = std::uint64_t(1) << ignored_bits;
-    std::uint64_t total = 0;
-    std::unordered_set<std::uint64_t> occupied;
-
-    for (const auto& entry : sizeByPointer) {
-        std::uint64_t pointer = entry.first;
-        std::uint64_t size = entry.second;
-        total += size;
-        while (size > ignored_size) {
-            occupied.insert(pointer >> ignored_bits);
-            pointer += ignored_size;
-            size -= ignored_size;
-        }
-        if (size > 0) {
-            occupied.insert(pointer >> ignored_bits);
-        }
+void report(std::uint64_t count, const std::vector<Occupancy>& occupancies) {
+    std::cout << "Processed " << count << " events, fragmentation =";
+    for (std::size_t i = 0; i < occupancies.size(); ++i) {
+        std::cout << (i == 0 ? " " : ", ") << occupancies[i].occupation()
+                  << " (2^" << static_cast<int>(occupancies[i].getBits())
+                  << " B)";
     }
-
-    return static_cast<double>(total)
-           / static_cast<double>(ignored_size * occupied.size());
+    std::cout << '\n' << std::flush;
 }
 } // namespace
 
 int main(int argc, char** argv) {
+    // Must precede any I/O. Only progress reports are flushed before exit.
+    std::ios::sync_with_stdio(false);
+
     auto program = argparse::ArgumentParser("benchmark_iterator", "",
                                             argparse::default_arguments::help);
     program.add_argument("-i", "--input")
@@ -47,11 +37,17 @@ int main(int argc, char** argv) {
         .default_value("events.bin")
         .metavar("FILE");
     program.add_argument("--ignored-bits")
-        .help("granularity at which to measure fragmentation (6: cache line, "
-              "12: page)")
-        .default_value(12)
+        .help("granularities at which to measure fragmentation (6: cache "
+              "line, 12: page, 21: huge page)")
+        .default_value(std::vector<std::uint8_t>({12}))
+        .nargs(argparse::nargs_pattern::at_least_one)
         .metavar("N")
         .scan<'u', std::uint8_t>();
+    program.add_argument("--every")
+        .help("report fragmentation every N events (default: 1000000)")
+        .default_value(std::uint64_t(1000000))
+        .metavar("N")
+        .scan<'u', std::uint64_t>();
 
     try {
         program.parse_args(argc, argv);
@@ -62,40 +58,65 @@ int main(int argc, char** argv) {
     }
 
     const auto input = program.get<std::string>("--input");
-    const auto ignoredBits = program.get<std::uint8_t>("--ignored-bits");
+    const auto ignoredBits
+        = program.get<std::vector<std::uint8_t>>("--ignored-bits");
+    const auto every = program.get<std::uint64_t>("--every");
 
-    std::ifstream input_file(input, std::ios::binary);
-    if (!input_file) {
-        std::cerr << "Failed to open " << input << std::endl;
-        std::exit(EXIT_FAILURE);
+    std::vector<Occupancy> occupancies;
+    occupancies.reserve(ignoredBits.size());
+    for (const auto bits : ignoredBits) {
+        if (bits >= 64) {
+            std::cerr << "Invalid granularity: " << static_cast<int>(bits)
+                      << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+        occupancies.emplace_back(bits);
     }
 
+    trace::Reader reader(input);
+
     std::uint64_t count = 0;
     Event event;
     std::unordered_map<std::uint64_t, std::uint64_t> sizeByPointer;
-    while (input_file.read(reinterpret_cast<char*>(&event), sizeof(event))) {
+    // Sized frees carry their size, other frees take it from the allocation.
+    const auto release = [&](std::uint64_t pointer, std::uint64_t size) {
+        const auto it = sizeByPointer.find(pointer);
+        assert(it != sizeByPointer.end());
+        if (it == sizeByPointer.end()) {
+            return;
+        }
+        if (size == 0) {
+            size = it->second;
+        }
+        for (auto& occupancy : occupancies) {
+            occupancy.remove(pointer, size);
+        }
+        sizeByPointer.erase(it);
+    };
+
+    while (reader.next(event)) {
         ++count;
         switch (event.type) {
             case EventType::Reallocation:
-                assert(sizeByPointer.contains(event.pointer));
-                sizeByPointer.erase(event.pointer);
+                release(event.pointer, 0);
                 [[fallthrough]];
             case EventType::Allocation:
                 assert(!sizeByPointer.contains(event.result));
                 sizeByPointer.emplace(event.result, event.size);
+                for (auto& occupancy : occupancies) {
+                    occupancy.add(event.result, event.size);
+                }
                 break;
             case EventType::Free:
-                assert(sizeByPointer.contains(event.pointer));
-                sizeByPointer.erase(event.pointer);
+                release(event.pointer, event.size);
                 break;
             default:
                 std::abort();
         }
 
-        if (count % 1000000 == 0) {
-            std::cout << "Processed " << count << " events, fragmentation = "
-                      << occupation(sizeByPointer, ignoredBits) << std::endl;
+        if (every != 0 && count % every == 0) {
+            report(count, occupancies);
         }
     }
-    std::cout << "Processed " << count << " events" << std::endl;
+    std::cout << "Processed " << count << " events" << '\n';
 }
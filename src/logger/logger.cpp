@@ -1,41 +1,276 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <chrono>
+#include <cstddef>
 #include <cstdint>
 #include <cstdlib>
-#include <fstream>
+#include <functional>
 #include <iostream>
-#include <mutex>
+#include <limits>
+#include <queue>
 #include <string>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <vector>
 
 #include <dlfcn.h>
+#include <fcntl.h>
 #include <interpose.h>
+#include <interpose_new.h>
+#include <pthread.h>
+#include <unistd.h>
 
 #include "shared.hpp"
+#include "trace.hpp"
 
 using Clock = std::chrono::steady_clock;
 
 namespace {
-bool initialized = false;
-std::ofstream output;
-std::mutex lock;
+const std::size_t kCacheLineSize = 64;
+const std::uint64_t kRingCapacity = 1 << 15;
+const std::size_t kWriteBatchSize = 1 << 16;
+const auto kWriterInterval = std::chrono::milliseconds(1);
+const std::uint64_t kIdle = std::numeric_limits<std::uint64_t>::max();
+
+// Single-producer single-consumer queue: the owning thread pushes its events,
+// the writer thread pops them. Rings are never freed, but are handed over to
+// new threads once their owner exits.
+struct Ring {
+    alignas(kCacheLineSize) std::atomic_uint64_t head = 0;
+    // While an event is being pushed, a lower bound of its timestamp.
+    std::atomic_uint64_t inFlightSince = kIdle;
+    alignas(kCacheLineSize) std::atomic_uint64_t tail = 0;
+    std::atomic_bool owned = true;
+    Ring* next = nullptr;
+    alignas(kCacheLineSize) std::array<Event, kRingCapacity> events;
+};
+
+struct Batch {
+    trace::Encoder encoder;
+    std::vector<char> bytes
+        = std::vector<char>(kWriteBatchSize + trace::kMaxRecordSize);
+    std::size_t size = 0;
+};
+
+std::atomic_bool initialized = false;
+int output = -1;
 Clock::time_point startTime;
+pthread_key_t ringKey;
+std::atomic<Ring*> rings = nullptr;
+std::atomic_bool stopping = false;
+std::thread writer;
+// Whether this is a forked child, in which the writer thread does not exist.
+bool forked = false;
+std::atomic_uint32_t nextThreadId = 1;
+
+thread_local int busy = 0;
+thread_local std::uint32_t threadId = 0;
+thread_local Ring* localRing = nullptr;
+thread_local std::uint64_t lastTimestamp = 0;
+
+std::uint64_t now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now()
+                                                                - startTime)
+        .count();
+}
+
+void releaseRing(void* ring) {
+    localRing = nullptr;
+    static_cast<Ring*>(ring)->owned = false;
+}
+
+Ring* getLocalRing() {
+    if (localRing != nullptr) [[likely]] {
+        return localRing;
+    }
+
+    for (auto* ring = rings.load(); ring != nullptr; ring = ring->next) {
+        bool expected = false;
+        if (ring->owned.compare_exchange_strong(expected, true)) {
+            localRing = ring;
+            break;
+        }
+    }
+
+    if (localRing == nullptr) {
+        ++busy;
+        auto* ring = new Ring();
+        --busy;
+        ring->next = rings.load();
+        while (!rings.compare_exchange_weak(ring->next, ring)) {
+        }
+        localRing = ring;
+    }
+
+    pthread_setspecific(ringKey, localRing);
+    return localRing;
+}
+
+void push(Ring& ring, const Event& event) {
+    const auto head = ring.head.load(std::memory_order_relaxed);
+    while (head - ring.tail.load(std::memory_order_acquire) == kRingCapacity) {
+        std::this_thread::yield();
+    }
+    ring.events[head % kRingCapacity] = event;
+    ring.head.store(head + 1, std::memory_order_release);
+}
+
+void write(const char* data, std::size_t remaining) {
+    while (remaining > 0) {
+        const auto written = ::write(output, data, remaining);
+        if (written <= 0) {
+            std::cerr << "Could not write events." << std::endl;
+            std::abort();
+        }
+        data += written;
+        remaining -= written;
+    }
+}
+
+void write(Batch& batch) {
+    write(batch.bytes.data(), batch.size);
+    batch.size = 0;
+}
+
+void append(Batch& batch, const Event& event) {
+    batch.size = batch.encoder.encode(batch.bytes.data() + batch.size, event)
+                 - batch.bytes.data();
+    if (batch.size >= kWriteBatchSize) {
+        write(batch);
+    }
+}
+
+// Writes, in timestamp order, all events that no event still to be pushed by
+// any thread can precede. Events from a given thread keep their order.
+std::size_t drain(Batch& batch, bool final) {
+    // Any event not yet in flight will be timestamped after this.
+    auto watermark = final ? kIdle : now();
+
+    std::vector<std::tuple<Ring*, std::uint64_t, std::uint64_t>> cursors;
+    for (auto* ring = rings.load(); ring != nullptr; ring = ring->next) {
+        if (!final) {
+            watermark = std::min(watermark, ring->inFlightSince.load());
+        }
+        cursors.emplace_back(ring,
+                             ring->tail.load(std::memory_order_relaxed),
+                             ring->head.load(std::memory_order_acquire));
+    }
+
+    const auto timestampAt = [&cursors](std::size_t i) {
+        const auto& [ring, tail, head] = cursors[i];
+        return ring->events[tail % kRingCapacity].timestamp_ns;
+    };
+
+    using Entry = std::pair<std::uint64_t, std::size_t>;
+    std::priority_queue<Entry, std::vector<Entry>, std::greater<>> queue;
+    for (std::size_t i = 0; i < cursors.size(); ++i) {
+        if (std::get<1>(cursors[i]) != std::get<2>(cursors[i])) {
+            queue.emplace(timestampAt(i), i);
+        }
+    }
+
+    std::size_t count = 0;
+    while (!queue.empty() && queue.top().first <= watermark) {
+        const auto i = queue.top().second;
+        queue.pop();
+
+        auto& [ring, tail, head] = cursors[i];
+        append(batch, ring->events[tail % kRingCapacity]);
+        ++count;
+        if (++tail != head) {
+            queue.emplace(timestampAt(i), i);
+        }
+    }
+
+    for (const auto& [ring, tail, head] : cursors) {
+        ring->tail.store(tail, std::memory_order_release);
+    }
+
+    write(batch);
+    return count;
+}
+
+void runWriter() {
+    // Allocations made by the writer itself are not logged.
+    busy = 1;
+
+    Batch batch;
+    while (!stopping) {
+        if (drain(batch, false) == 0) {
+            std::this_thread::sleep_for(kWriterInterval);
+        }
+    }
+    drain(batch, true);
+}
+
+// A forked child has no writer thread to empty its rings, and would write to
+// the same output as its parent: it is not logged.
+void disableInChild() {
+    initialized = false;
+    forked = true;
+}
 
 const struct Initialization {
     Initialization() {
         Dl_info info;
-        const auto next = GET_REAL_FUNCTION(malloc);
-        const int status = dladdr(reinterpret_cast<void*>(next), &info);
+        const int status = dladdr(interpose::real::mallocAddress(), &info);
         const std::string object = (status != 0) ? info.dli_fname : "[unknown]";
         std::cerr << "Using malloc from: " << object << std::endl;
 
-        output = std::ofstream("events.bin", std::ios::binary);
+        output = open("events.bin", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (output == -1) {
+            std::cerr << "Could not open events.bin." << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+
+        const auto header = trace::encodeHeader(
+            {.pid = static_cast<std::uint64_t>(getpid()),
+             .clock = "std::chrono::steady_clock",
+             .mallocObject = object});
+        write(header.data(), header.size());
+
+        if (pthread_key_create(&ringKey, &releaseRing) != 0) {
+            std::cerr << "Could not create ring key." << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+
+        if (pthread_atfork(nullptr, nullptr, &disableInChild) != 0) {
+            std::cerr << "Could not register fork handler." << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+
         startTime = Clock::now();
+
+        ++busy;
+        writer = std::thread(runWriter);
+        --busy;
+
         initialized = true;
     };
+
+    ~Initialization() {
+        initialized = false;
+        if (forked) {
+            // Only the parent's writer was ever running.
+            writer.detach();
+            close(output);
+            return;
+        }
+        stopping = true;
+        writer.join();
+        close(output);
+    }
+
+    Initialization(const Initialization&) = delete;
+    Initialization& operator=(const Initialization&) = delete;
+    Initialization(Initialization&&) = delete;
+    Initialization& operator=(Initialization&&) = delete;
 } _;
 
 void processEvent(Event event) {
-    static thread_local int busy = 0;
-    if (!initialized || busy > 0) {
+    if (!initialized || busy > 0 || interpose::insideOperator()) {
         return;
     }
 
@@ -47,24 +282,41 @@ void processEvent(Event event) {
         return;
     }
 
-    event.timestamp_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
-                             Clock::now() - startTime)
-                             .count();
-
     if (event.type == EventType::Free && event.pointer == 0) [[unlikely]] {
         return;
     }
 
-    ++busy;
-    const std::unique_lock<std::mutex> guard(lock);
-    output.write(reinterpret_cast<const char*>(&event), sizeof(event));
-    --busy;
+    auto* ring = getLocalRing();
+    if (threadId == 0) [[unlikely]] {
+        threadId = nextThreadId++;
+    }
+    event.thread = threadId;
+
+    // The writer may not write any event past this point until it is pushed.
+    ring->inFlightSince = lastTimestamp;
+    event.timestamp_ns = now();
+    lastTimestamp = event.timestamp_ns;
+    push(*ring, event);
+    ring->inFlightSince = kIdle;
 }
 } // namespace
 
+void interpose::onNew(std::size_t size, void* result, void* /*frame*/) {
+    processEvent({.type = EventType::Allocation,
+                  .size = size,
+                  .result = reinterpret_cast<std::uint64_t>(result)});
+}
+
+// Sized deletes record the size of the object, so that it need not be looked
+// up from its allocation.
+void interpose::onDelete(void* pointer, std::size_t size, void* /*frame*/) {
+    processEvent({.type = EventType::Free,
+                  .size = size,
+                  .pointer = reinterpret_cast<std::uint64_t>(pointer)});
+}
+
 extern "C" void* INTERPOSE_FUNCTION_NAME(malloc)(uint64_t size) {
-    static auto* next = GET_REAL_FUNCTION(malloc);
-    void* result = next(size);
+    void* result = interpose::real::malloc(size);
     processEvent({.type = EventType::Allocation,
                   .size = size,
                   .result = reinterpret_cast<std::uint64_t>(result)});
@@ -73,16 +325,14 @@ extern "C" void* INTERPOSE_FUNCTION_NAME(malloc)(uint64_t size) {
 INTERPOSE(malloc);
 
 extern "C" void INTERPOSE_FUNCTION_NAME(free)(void* pointer) {
-    static auto* next = GET_REAL_FUNCTION(free);
     processEvent({.type = EventType::Free,
                   .pointer = reinterpret_cast<std::uint64_t>(pointer)});
-    next(pointer);
+    interpose::real::free(pointer);
 }
 INTERPOSE(free);
 
 extern "C" void* INTERPOSE_FUNCTION_NAME(calloc)(uint64_t n, uint64_t size) {
-    static auto* next = GET_REAL_FUNCTION(calloc);
-    void* result = next(n, size);
+    void* result = interpose::real::calloc(n, size);
     processEvent({.type = EventType::Allocation,
                   .size = n * size,
                   .result = reinterpret_cast<std::uint64_t>(result)});
@@ -92,8 +342,7 @@ INTERPOSE(calloc);
 
 extern "C" void* INTERPOSE_FUNCTION_NAME(realloc)(void* pointer,
                                                   uint64_t size) {
-    static auto* next = GET_REAL_FUNCTION(realloc);
-    void* result = next(pointer, size);
+    void* result = interpose::real::realloc(pointer, size);
     processEvent({.type = EventType::Reallocation,
                   .size = size,
                   .pointer = reinterpret_cast<std::uint64_t>(pointer),
@@ -106,8 +355,7 @@ INTERPOSE(realloc);
 extern "C" void* INTERPOSE_FUNCTION_NAME(reallocarray)(void* pointer,
                                                        uint64_t n,
                                                        uint64_t size) {
-    static auto* next = GET_REAL_FUNCTION(reallocarray);
-    void* result = next(pointer, n, size);
+    void* result = interpose::real::reallocarray(pointer, n, size);
     processEvent({.type = EventType::Reallocation,
                   .size = n * size,
                   .pointer = reinterpret_cast<std::uint64_t>(pointer),
@@ -120,8 +368,7 @@ INTERPOSE(reallocarray);
 extern "C" int INTERPOSE_FUNCTION_NAME(posix_memalign)(void** memptr,
                                                        uint64_t alignment,
                                                        uint64_t size) {
-    static auto* next = GET_REAL_FUNCTION(posix_memalign);
-    const int result = next(memptr, alignment, size);
+    const int result = interpose::real::posix_memalign(memptr, alignment, size);
     processEvent({.type = EventType::Allocation,
                   .size = size,
                   .result = reinterpret_cast<std::uint64_t>(*memptr)});
@@ -131,8 +378,7 @@ INTERPOSE(posix_memalign);
 
 extern "C" void* INTERPOSE_FUNCTION_NAME(aligned_alloc)(uint64_t alignment,
                                                         uint64_t size) {
-    static auto* next = GET_REAL_FUNCTION(aligned_alloc);
-    void* result = next(alignment, size);
+    void* result = interpose::real::aligned_alloc(alignment, size);
     processEvent({.type = EventType::Allocation,
                   .size = size,
                   .result = reinterpret_cast<std::uint64_t>(result)});
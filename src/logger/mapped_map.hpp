@@ -0,0 +1,157 @@
+#ifndef LOGGER_MAPPED_MAP_HPP
+#define LOGGER_MAPPED_MAP_HPP
+
+#include <sys/mman.h>
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <type_traits>
+#include <utility>
+
+// Maps non-zero keys to values. Open addressing with linear probing and
+// backward-shift deletion, so erasing leaves no tombstones behind; 0 marks
+// empty slots. Slots come from mmap rather than malloc: tools measuring an
+// allocator keep their bookkeeping out of the heap they measure.
+//
+// Values must be trivially copyable, and all zeros must be their default.
+template <typename Value>
+class MappedMap {
+    static_assert(std::is_trivially_copyable_v<Value>);
+
+  public:
+    MappedMap() {
+        allocate(kInitialCapacity);
+    }
+
+    ~MappedMap() {
+        release();
+    }
+
+    MappedMap(const MappedMap&) = delete;
+    MappedMap& operator=(const MappedMap&) = delete;
+
+    MappedMap(MappedMap&& other) noexcept
+        : slots(std::exchange(other.slots, nullptr)),
+          capacity(std::exchange(other.capacity, 0)),
+          count(std::exchange(other.count, 0)) {}
+
+    MappedMap& operator=(MappedMap&& other) noexcept {
+        std::swap(slots, other.slots);
+        std::swap(capacity, other.capacity);
+        std::swap(count, other.count);
+        return *this;
+    }
+
+    // Returns nullptr if the key is not in the map.
+    Value* find(std::uint64_t key) {
+        for (auto i = indexOf(key); slots[i].key != 0; i = (i + 1) & mask()) {
+            if (slots[i].key == key) {
+                return &slots[i].value;
+            }
+        }
+        return nullptr;
+    }
+
+    void insert(std::uint64_t key, Value value) {
+        if (2 * (count + 1) > capacity) {
+            grow();
+        }
+
+        auto i = indexOf(key);
+        while (slots[i].key != 0 && slots[i].key != key) {
+            i = (i + 1) & mask();
+        }
+        count += static_cast<std::size_t>(slots[i].key == 0);
+        slots[i] = {key, value};
+    }
+
+    // Returns a default value if the key is not in the map.
+    Value erase(std::uint64_t key) {
+        auto i = indexOf(key);
+        while (slots[i].key != key) {
+            if (slots[i].key == 0) {
+                return {};
+            }
+            i = (i + 1) & mask();
+        }
+
+        const auto value = slots[i].value;
+        --count;
+
+        // Move back any later entry of the cluster which may not be reached
+        // anymore once this slot is empty.
+        for (auto j = (i + 1) & mask(); slots[j].key != 0;
+             j = (j + 1) & mask()) {
+            const auto home = indexOf(slots[j].key);
+            if (((j - home) & mask()) >= ((j - i) & mask())) {
+                slots[i] = slots[j];
+                i = j;
+            }
+        }
+        slots[i] = {};
+        return value;
+    }
+
+    [[nodiscard]] std::size_t size() const {
+        return count;
+    }
+
+  private:
+    static constexpr std::size_t kInitialCapacity = 1 << 16;
+
+    struct Slot {
+        std::uint64_t key;
+        Value value;
+    };
+
+    [[nodiscard]] std::size_t mask() const {
+        return capacity - 1;
+    }
+
+    [[nodiscard]] std::size_t indexOf(std::uint64_t key) const {
+        const auto shift = 64 - std::countr_zero(capacity);
+        return static_cast<std::size_t>((key * 0x9E3779B97F4A7C15) >> shift);
+    }
+
+    // Anonymous mappings are zeroed, which is what empty slots look like.
+    void allocate(std::size_t newCapacity) {
+        void* memory = mmap(nullptr, newCapacity * sizeof(Slot),
+                            PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) {
+            std::cerr << "Could not map " << newCapacity * sizeof(Slot)
+                      << " bytes." << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+        slots = static_cast<Slot*>(memory);
+        capacity = newCapacity;
+        count = 0;
+    }
+
+    void release() {
+        if (slots != nullptr) {
+            munmap(slots, capacity * sizeof(Slot));
+        }
+    }
+
+    void grow() {
+        auto* old = slots;
+        const auto oldCapacity = capacity;
+        allocate(2 * oldCapacity);
+        for (std::size_t i = 0; i < oldCapacity; ++i) {
+            if (old[i].key != 0) {
+                insert(old[i].key, old[i].value);
+            }
+        }
+        munmap(old, oldCapacity * sizeof(Slot));
+    }
+
+    Slot* slots = nullptr;
+    std::size_t capacity = 0;
+    std::size_t count = 0;
+};
+
+#endif // LOGGER_MAPPED_MAP_HPP
@@ -0,0 +1,113 @@
+#ifndef LOGGER_OCCUPANCY_HPP
+#define LOGGER_OCCUPANCY_HPP
+
+#include <cassert>
+#include <cstdint>
+
+#include "mapped_map.hpp"
+
+// Incrementally tracks how many live bytes each block of 2^bits bytes holds.
+// Blocks entirely covered by a single object cannot be shared, so they are only
+// counted; only the (at most two) partially covered blocks at the ends of an
+// object are tracked individually. Adding or removing an object is O(1), and
+// never allocates from malloc.
+class Occupancy {
+  public:
+    explicit Occupancy(std::uint8_t bits) : bits(bits) {
+        assert(bits < 64);
+    }
+
+    void add(std::uint64_t pointer, std::uint64_t size) {
+        liveBytes += size;
+        update(pointer, size, true);
+    }
+
+    void remove(std::uint64_t pointer, std::uint64_t size) {
+        assert(liveBytes >= size);
+        liveBytes -= size;
+        update(pointer, size, false);
+    }
+
+    [[nodiscard]] std::uint8_t getBits() const {
+        return bits;
+    }
+
+    [[nodiscard]] std::uint64_t occupiedBlocks() const {
+        return fullBlocks + partialBlocks.size();
+    }
+
+    // Live bytes over the total size of blocks holding any live byte.
+    [[nodiscard]] double occupation() const {
+        if (occupiedBlocks() == 0) {
+            return 1;
+        }
+        return static_cast<double>(liveBytes)
+               / static_cast<double>(blockSize() * occupiedBlocks());
+    }
+
+  private:
+    [[nodiscard]] std::uint64_t blockSize() const {
+        return std::uint64_t(1) << bits;
+    }
+
+    void update(std::uint64_t pointer, std::uint64_t size, bool adding) {
+        if (size == 0) {
+            return;
+        }
+
+        const auto first = pointer >> bits;
+        const auto last = (pointer + size - 1) >> bits;
+        if (first == last) {
+            updateBlock(first, size, adding);
+            return;
+        }
+
+        updateBlock(first, ((first + 1) << bits) - pointer, adding);
+        updateBlock(last, pointer + size - (last << bits), adding);
+        if (adding) {
+            fullBlocks += last - first - 1;
+        } else {
+            fullBlocks -= last - first - 1;
+        }
+    }
+
+    void updateBlock(std::uint64_t block, std::uint64_t bytes, bool adding) {
+        if (bytes == blockSize()) {
+            if (adding) {
+                ++fullBlocks;
+            } else {
+                --fullBlocks;
+            }
+            return;
+        }
+
+        const auto key = block + 1;
+        auto* partialBytes = partialBlocks.find(key);
+        if (adding) {
+            if (partialBytes != nullptr) {
+                *partialBytes += bytes;
+            } else {
+                partialBlocks.insert(key, bytes);
+            }
+            return;
+        }
+
+        assert(partialBytes != nullptr && *partialBytes >= bytes);
+        if (partialBytes == nullptr) {
+            return;
+        }
+        *partialBytes -= bytes;
+        if (*partialBytes == 0) {
+            partialBlocks.erase(key);
+        }
+    }
+
+    std::uint8_t bits;
+    std::uint64_t liveBytes = 0;
+    std::uint64_t fullBlocks = 0;
+    // Live bytes of each partially covered block, keyed by its number plus one
+    // as 0 marks empty slots.
+    MappedMap<std::uint64_t> partialBlocks;
+};
+
+#endif // LOGGER_OCCUPANCY_HPP
@@ -0,0 +1,354 @@
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <dlfcn.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <argparse/argparse.hpp>
+
+#include "mapped_map.hpp"
+#include "occupancy.hpp"
+#include "shared.hpp"
+#include "trace.hpp"
+
+using Clock = std::chrono::steady_clock;
+
+namespace {
+struct Object {
+    void* pointer = nullptr;
+    std::uint64_t size = 0;
+};
+
+// Maps recorded pointers to replayed objects. Recorded pointers are never 0.
+// Like the occupancies, it is kept out of the allocator being replayed.
+using PointerMap = MappedMap<Object>;
+
+// Log-linear latency histogram, 8 buckets per power of two.
+class Histogram {
+  public:
+    void record(std::uint64_t ns) {
+        ++counts[bucketOf(ns)];
+        ++total;
+    }
+
+    [[nodiscard]] std::uint64_t count() const {
+        return total;
+    }
+
+    // Upper bound of the bucket holding the given quantile.
+    [[nodiscard]] std::uint64_t quantile(double q) const {
+        const auto target = static_cast<std::uint64_t>(
+            q * static_cast<double>(total - 1));
+        std::uint64_t seen = 0;
+        for (std::size_t i = 0; i < counts.size(); ++i) {
+            seen += counts[i];
+            if (seen > target) {
+                return upperBoundOf(i);
+            }
+        }
+        return upperBoundOf(counts.size() - 1);
+    }
+
+  private:
+    static constexpr int kSubBucketBits = 3;
+    static constexpr std::uint64_t kSubBuckets = 1 << kSubBucketBits;
+
+    static std::size_t bucketOf(std::uint64_t ns) {
+        if (ns < kSubBuckets) {
+            return ns;
+        }
+        const auto exponent = std::bit_width(ns) - 1;
+        const auto subBucket
+            = (ns >> (exponent - kSubBucketBits)) & (kSubBuckets - 1);
+        return ((exponent - kSubBucketBits + 1) << kSubBucketBits) + subBucket;
+    }
+
+    static std::uint64_t upperBoundOf(std::size_t bucket) {
+        if (bucket < kSubBuckets) {
+            return bucket;
+        }
+        const auto shift = (bucket >> kSubBucketBits) - 1;
+        const auto lower = (kSubBuckets + (bucket & (kSubBuckets - 1)))
+                           << shift;
+        return lower + (std::uint64_t(1) << shift) - 1;
+    }
+
+    std::array<std::uint64_t, (64 - kSubBucketBits + 1) << kSubBucketBits>
+        counts{};
+    std::uint64_t total = 0;
+};
+
+// Anonymous resident memory, which excludes the mapped trace, in bytes.
+// Returns 0 if unavailable.
+std::uint64_t anonymousResidentBytes() {
+    std::FILE* statm = std::fopen("/proc/self/statm", "r");
+    if (statm == nullptr) {
+        return 0;
+    }
+    unsigned long long size = 0;
+    unsigned long long resident = 0;
+    unsigned long long shared = 0;
+    const int n = std::fscanf(statm, "%llu %llu %llu", &size, &resident,
+                              &shared);
+    std::fclose(statm);
+    if (n != 3) {
+        return 0;
+    }
+    return (resident - shared) * static_cast<std::uint64_t>(getpagesize());
+}
+
+void printLatencies(const std::string& name, const Histogram& histogram) {
+    std::cout << std::left << std::setw(18) << name << ": ";
+    if (histogram.count() == 0) {
+        std::cout << "-" << std::endl;
+        return;
+    }
+    std::cout << "p50 " << histogram.quantile(0.5) << " ns, p90 "
+              << histogram.quantile(0.9) << " ns, p99 "
+              << histogram.quantile(0.99) << " ns, p99.9 "
+              << histogram.quantile(0.999) << " ns, max "
+              << histogram.quantile(1) << " ns (" << histogram.count()
+              << " ops)" << std::endl;
+}
+} // namespace
+
+int main(int argc, char** argv) {
+    auto program = argparse::ArgumentParser("replay", "",
+                                            argparse::default_arguments::help);
+    program.add_argument("-i", "--input")
+        .help("input file, generated by the logger tool")
+        .default_value("events.bin")
+        .metavar("FILE");
+    program.add_argument("--no-touch")
+        .help("do not write to allocated memory")
+        .default_value(false)
+        .implicit_value(true);
+    program.add_argument("--ignored-bits")
+        .help("granularities at which to measure fragmentation (6: cache "
+              "line, 12: page, 21: huge page)")
+        .default_value(std::vector<std::uint8_t>({6, 12}))
+        .nargs(argparse::nargs_pattern::at_least_one)
+        .metavar("N")
+        .scan<'u', std::uint8_t>();
+    program.add_argument("--sample-every")
+        .help("sample memory usage every N events (default: 65536)")
+        .default_value(std::uint64_t(65536))
+        .metavar("N")
+        .scan<'u', std::uint64_t>();
+
+    try {
+        program.parse_args(argc, argv);
+    } catch (const std::exception& err) {
+        std::cerr << err.what() << std::endl;
+        std::cerr << program;
+        std::exit(EXIT_FAILURE);
+    }
+
+    const auto input = program.get<std::string>("--input");
+    const auto touch = !program.get<bool>("--no-touch");
+    const auto ignoredBits
+        = program.get<std::vector<std::uint8_t>>("--ignored-bits");
+    const auto sampleEvery = std::max<std::uint64_t>(
+        1, program.get<std::uint64_t>("--sample-every"));
+
+    std::vector<Occupancy> occupancies;
+    occupancies.reserve(ignoredBits.size());
+    for (const auto bits : ignoredBits) {
+        if (bits >= 64) {
+            std::cerr << "Invalid granularity: " << static_cast<int>(bits)
+                      << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+        occupancies.emplace_back(bits);
+    }
+
+    trace::Reader reader(input);
+
+    Dl_info mallocInfo;
+    const int status = dladdr(reinterpret_cast<void*>(&malloc), &mallocInfo);
+    const std::string mallocObject
+        = (status != 0) ? mallocInfo.dli_fname : "[unknown]";
+
+    std::cout << "malloc            : " << mallocObject << std::endl;
+    std::cout << "trace             : " << input << " (pid "
+              << reader.getHeader().pid << ", "
+              << reader.getHeader().mallocObject << ")" << std::endl;
+
+    PointerMap objects;
+    Histogram mallocLatencies;
+    Histogram reallocLatencies;
+    Histogram freeLatencies;
+    std::uint64_t count = 0;
+    std::uint64_t unmatched = 0;
+    std::uint64_t liveBytes = 0;
+    std::uint64_t peakResidentBytes = 0;
+    std::uint64_t peakLiveBytes = 0;
+    std::uint64_t residentBytesAtPeakLive = 0;
+    std::vector<double> occupationsAtPeakLive(occupancies.size());
+
+    const auto track = [&](std::uint64_t key, Object object) {
+        objects.insert(key, object);
+        liveBytes += object.size;
+        for (auto& occupancy : occupancies) {
+            occupancy.add(reinterpret_cast<std::uintptr_t>(object.pointer),
+                          object.size);
+        }
+        if (touch) {
+            std::memset(object.pointer, 0, object.size);
+        }
+    };
+
+    // Sized frees carry their size, other frees take it from the allocation.
+    const auto untrack = [&](std::uint64_t key, std::uint64_t size) {
+        auto object = objects.erase(key);
+        if (object.pointer == nullptr) {
+            ++unmatched;
+            return object;
+        }
+        if (size != 0) {
+            object.size = size;
+        }
+        liveBytes -= object.size;
+        for (auto& occupancy : occupancies) {
+            occupancy.remove(reinterpret_cast<std::uintptr_t>(object.pointer),
+                             object.size);
+        }
+        return object;
+    };
+
+    const auto sample = [&]() {
+        const auto residentBytes = anonymousResidentBytes();
+        peakResidentBytes = std::max(peakResidentBytes, residentBytes);
+        if (liveBytes > peakLiveBytes) {
+            peakLiveBytes = liveBytes;
+            residentBytesAtPeakLive = residentBytes;
+            for (std::size_t i = 0; i < occupancies.size(); ++i) {
+                occupationsAtPeakLive[i] = occupancies[i].occupation();
+            }
+        }
+    };
+
+    const auto start = Clock::now();
+
+    Event event;
+    while (reader.next(event)) {
+        ++count;
+        switch (event.type) {
+            case EventType::Allocation: {
+                if (event.result == 0) {
+                    break;
+                }
+                const auto before = Clock::now();
+                void* pointer = std::malloc(event.size);
+                const auto after = Clock::now();
+                mallocLatencies.record(
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        after - before)
+                        .count());
+                if (pointer != nullptr) {
+                    track(event.result, {pointer, event.size});
+                }
+                break;
+            }
+            case EventType::Reallocation: {
+                const auto old = untrack(event.pointer, 0);
+                const auto before = Clock::now();
+                void* pointer = std::realloc(old.pointer, event.size);
+                const auto after = Clock::now();
+                reallocLatencies.record(
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        after - before)
+                        .count());
+                if (pointer == nullptr) {
+                    break;
+                }
+                if (event.result == 0) {
+                    // Recorded as a free (realloc to 0 bytes), but the object
+                    // was reallocated here: it would otherwise leak.
+                    std::free(pointer);
+                    break;
+                }
+                track(event.result, {pointer, event.size});
+                break;
+            }
+            case EventType::Free: {
+                const auto object = untrack(event.pointer, event.size);
+                if (object.pointer == nullptr) {
+                    break;
+                }
+                const auto before = Clock::now();
+                std::free(object.pointer);
+                const auto after = Clock::now();
+                freeLatencies.record(
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        after - before)
+                        .count());
+                break;
+            }
+            default:
+                std::abort();
+        }
+
+        if (count % sampleEvery == 0) {
+            sample();
+        }
+    }
+    sample();
+
+    const auto end = Clock::now();
+    const auto elapsed_ms
+        = std::chrono::duration_cast<std::chrono::milliseconds>(end - start)
+              .count();
+
+    struct rusage usage {};
+    getrusage(RUSAGE_SELF, &usage);
+    // ru_maxrss is in KiB, except on macOS where it is in bytes.
+#ifdef __APPLE__
+    const auto maxResidentKibibytes = usage.ru_maxrss / 1024;
+#else
+    const auto maxResidentKibibytes = usage.ru_maxrss;
+#endif
+
+    std::cout << "events            : " << count << " (" << unmatched
+              << " unmatched)" << std::endl;
+    std::cout << "Time elapsed: " << elapsed_ms << " ms" << std::endl;
+    std::cout << "throughput        : "
+              << static_cast<double>(count) * 1000.0
+                     / static_cast<double>(std::max<long long>(1, elapsed_ms))
+              << " events/s" << std::endl;
+    printLatencies("malloc latency", mallocLatencies);
+    printLatencies("realloc latency", reallocLatencies);
+    printLatencies("free latency", freeLatencies);
+    std::cout << "peak RSS          : " << peakResidentBytes / 1024
+              << " KiB (anonymous), " << maxResidentKibibytes
+              << " KiB (ru_maxrss)" << std::endl;
+    std::cout << "peak live         : " << peakLiveBytes / 1024 << " KiB"
+              << std::endl;
+    if (residentBytesAtPeakLive != 0) {
+        std::cout << "live / RSS        : "
+                  << static_cast<double>(peakLiveBytes)
+                         / static_cast<double>(residentBytesAtPeakLive)
+                  << " (at peak live)" << std::endl;
+    }
+    for (std::size_t i = 0; i < occupancies.size(); ++i) {
+        std::cout << "fragmentation 2^" << std::left << std::setw(2)
+                  << static_cast<int>(occupancies[i].getBits()) << ": "
+                  << occupationsAtPeakLive[i] << " (at peak live), "
+                  << occupancies[i].occupation() << " (at end)" << std::endl;
+    }
+
+    // The remaining objects are intentionally leaked.
+}
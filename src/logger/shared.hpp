@@ -13,6 +13,7 @@ enum class EventType : std::uint8_t {
 
 struct Event {
     EventType type = EventType::Null;
+    std::uint32_t thread = 0;
     std::uint64_t size = 0;
     std::uint64_t pointer = 0;
     std::uint64_t result = 0;
@@ -0,0 +1,367 @@
+#ifndef LOGGER_TRACE_HPP
+#define LOGGER_TRACE_HPP
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <span>
+#include <string>
+
+#ifdef _WIN32
+#include <fstream>
+#include <ios>
+#include <iterator>
+#include <vector>
+#endif
+
+#include "shared.hpp"
+
+// Trace format (version 2), as written by the logger to events.bin.
+//
+// The file starts with a header:
+//   - the 8 bytes kMagic,
+//   - varint version,
+//   - varint pid,
+//   - string clock source,
+//   - string malloc object,
+// where a string is a varint length followed by that many bytes.
+//
+// It is followed by records, in timestamp order. Each record starts with a tag
+// byte, holding the event type in its low two bits, and kSameThread if the
+// record comes from the same thread as the previous one, and kFreeSize if a
+// Free record carries the size of the object (from a sized operator delete).
+// Then:
+//   - varint thread id (only without kSameThread),
+//   - zigzag varint timestamp delta,
+//   - Allocation: varint size, zigzag varint result delta,
+//   - Reallocation: varint size, zigzag varint pointer delta, zigzag varint
+//     result delta,
+//   - Free: varint size (only with kFreeSize), zigzag varint pointer delta.
+// Version 1 is the same, without kFreeSize.
+// Timestamps are deltas from the previous record. Pointers are deltas from the
+// previous pointer in the file, since consecutive events tend to be close.
+// Varints are unsigned LEB128.
+
+namespace trace {
+constexpr std::array<char, 8> kMagic = {'L', 'I', 'T', 'T', 'R', 'A', 'C', 'E'};
+constexpr std::uint64_t kVersion = 2;
+constexpr std::uint64_t kMinVersion = 1;
+constexpr std::uint8_t kTypeMask = 0x3;
+constexpr std::uint8_t kSameThread = 0x4;
+constexpr std::uint8_t kFreeSize = 0x8;
+// Tag, then at most five varints (thread, timestamp, size, two pointers).
+constexpr std::size_t kMaxRecordSize = 1 + (5 * 10);
+
+struct Header {
+    std::uint64_t version = kVersion;
+    std::uint64_t pid = 0;
+    std::string clock;
+    std::string mallocObject;
+};
+
+namespace detail {
+inline std::uint64_t zigzag(std::uint64_t delta) {
+    return (delta << 1) ^ (0 - (delta >> 63));
+}
+
+inline std::uint64_t unzigzag(std::uint64_t value) {
+    return (value >> 1) ^ (0 - (value & 1));
+}
+
+inline char* putVarint(char* out, std::uint64_t value) {
+    while (value >= 0x80) {
+        *out++ = static_cast<char>((value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    *out++ = static_cast<char>(value);
+    return out;
+}
+
+// Returns nullptr on a truncated varint.
+inline const char* getVarint(const char* in, const char* end,
+                             std::uint64_t& value) {
+    value = 0;
+    for (unsigned shift = 0; in != end && shift < 64; shift += 7) {
+        const auto byte = static_cast<std::uint8_t>(*in++);
+        value |= std::uint64_t(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) {
+            return in;
+        }
+    }
+    return nullptr;
+}
+
+inline void putString(std::string& out, const std::string& value) {
+    std::array<char, 10> buffer{};
+    out.append(buffer.data(), putVarint(buffer.data(), value.size()));
+    out.append(value);
+}
+} // namespace detail
+
+inline std::string encodeHeader(const Header& header) {
+    std::string out(kMagic.begin(), kMagic.end());
+    std::array<char, 10> buffer{};
+    out.append(buffer.data(), detail::putVarint(buffer.data(), header.version));
+    out.append(buffer.data(), detail::putVarint(buffer.data(), header.pid));
+    detail::putString(out, header.clock);
+    detail::putString(out, header.mallocObject);
+    return out;
+}
+
+// Encoder and Decoder must see the same sequence of events.
+class Encoder {
+  public:
+    // Writes at most kMaxRecordSize bytes to out, returns the new end.
+    char* encode(char* out, const Event& event) {
+        auto tag = static_cast<std::uint8_t>(event.type);
+        if (event.thread == lastThread) {
+            tag |= kSameThread;
+        }
+        if (event.type == EventType::Free && event.size != 0) {
+            tag |= kFreeSize;
+        }
+        *out++ = static_cast<char>(tag);
+        if (event.thread != lastThread) {
+            out = detail::putVarint(out, event.thread);
+            lastThread = event.thread;
+        }
+
+        out = detail::putVarint(
+            out, detail::zigzag(event.timestamp_ns - lastTimestamp));
+        lastTimestamp = event.timestamp_ns;
+
+        if (event.type != EventType::Free || (tag & kFreeSize) != 0) {
+            out = detail::putVarint(out, event.size);
+        }
+        if (event.type != EventType::Allocation) {
+            out = putAddress(out, event.pointer);
+        }
+        if (event.type != EventType::Free) {
+            out = putAddress(out, event.result);
+        }
+        return out;
+    }
+
+  private:
+    char* putAddress(char* out, std::uint64_t address) {
+        out = detail::putVarint(out, detail::zigzag(address - lastAddress));
+        lastAddress = address;
+        return out;
+    }
+
+    std::uint32_t lastThread = 0;
+    std::uint64_t lastTimestamp = 0;
+    std::uint64_t lastAddress = 0;
+};
+
+class Decoder {
+  public:
+    // Returns the end of the decoded record, or nullptr if [in, end) does not
+    // hold a full record.
+    const char* decode(const char* in, const char* end, Event& event) {
+        if (in == end) {
+            return nullptr;
+        }
+
+        const auto tag = static_cast<std::uint8_t>(*in++);
+        event = Event();
+        event.type = static_cast<EventType>(tag & kTypeMask);
+
+        std::uint64_t value = 0;
+        if ((tag & kSameThread) == 0) {
+            in = detail::getVarint(in, end, value);
+            if (in == nullptr) {
+                return nullptr;
+            }
+            lastThread = static_cast<std::uint32_t>(value);
+        }
+        event.thread = lastThread;
+
+        in = detail::getVarint(in, end, value);
+        if (in == nullptr) {
+            return nullptr;
+        }
+        lastTimestamp += detail::unzigzag(value);
+        event.timestamp_ns = lastTimestamp;
+
+        if (event.type != EventType::Free || (tag & kFreeSize) != 0) {
+            in = detail::getVarint(in, end, event.size);
+            if (in == nullptr) {
+                return nullptr;
+            }
+        }
+        if (event.type != EventType::Allocation) {
+            in = getAddress(in, end, event.pointer);
+            if (in == nullptr) {
+                return nullptr;
+            }
+        }
+        if (event.type != EventType::Free) {
+            in = getAddress(in, end, event.result);
+            if (in == nullptr) {
+                return nullptr;
+            }
+        }
+        return in;
+    }
+
+  private:
+    const char* getAddress(const char* in, const char* end,
+                           std::uint64_t& address) {
+        std::uint64_t value = 0;
+        in = detail::getVarint(in, end, value);
+        if (in == nullptr) {
+            return nullptr;
+        }
+        lastAddress += detail::unzigzag(value);
+        address = lastAddress;
+        return in;
+    }
+
+    std::uint32_t lastThread = 0;
+    std::uint64_t lastTimestamp = 0;
+    std::uint64_t lastAddress = 0;
+};
+
+// Maps a trace file in memory, and decodes events straight from the mapping.
+class Reader {
+  public:
+    explicit Reader(const std::string& filename) {
+#ifdef _WIN32
+        std::ifstream input(filename, std::ios::binary);
+        if (!input) {
+            fail("Failed to open " + filename);
+        }
+        contents.assign(std::istreambuf_iterator<char>(input),
+                        std::istreambuf_iterator<char>());
+        begin = contents.data();
+        end = begin + contents.size();
+#else
+        const int fd = open(filename.c_str(), O_RDONLY);
+        struct stat status {};
+        if (fd == -1 || fstat(fd, &status) != 0) {
+            fail("Failed to open " + filename);
+        }
+
+        mappingSize = static_cast<std::size_t>(status.st_size);
+        if (mappingSize != 0) {
+            mapping = mmap(nullptr, mappingSize, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping == MAP_FAILED) {
+                fail("Failed to map " + filename);
+            }
+            // Both are hints, failures are fine.
+            madvise(mapping, mappingSize, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+            madvise(mapping, mappingSize, MADV_HUGEPAGE);
+#endif
+            begin = static_cast<const char*>(mapping);
+            end = begin + mappingSize;
+        }
+        close(fd);
+#endif
+
+        if (available() < kMagic.size()
+            || !std::equal(kMagic.begin(), kMagic.end(), begin)) {
+            fail(filename + " is not a trace file.");
+        }
+        begin += kMagic.size();
+
+        if (!readVarint(header.version) || header.version < kMinVersion
+            || header.version > kVersion) {
+            fail("Unsupported trace version in " + filename);
+        }
+        if (!readVarint(header.pid) || !readString(header.clock)
+            || !readString(header.mallocObject)) {
+            fail("Truncated header in " + filename);
+        }
+    }
+
+    ~Reader() {
+#ifndef _WIN32
+        if (mapping != nullptr) {
+            munmap(mapping, mappingSize);
+        }
+#endif
+    }
+
+    Reader(const Reader&) = delete;
+    Reader& operator=(const Reader&) = delete;
+    Reader(Reader&&) = delete;
+    Reader& operator=(Reader&&) = delete;
+
+    [[nodiscard]] const Header& getHeader() const {
+        return header;
+    }
+
+    // The encoded records not decoded yet.
+    [[nodiscard]] std::span<const char> records() const {
+        return {begin, end};
+    }
+
+    // Returns false at the end of the trace.
+    bool next(Event& event) {
+        const auto* next = decoder.decode(begin, end, event);
+        if (next == nullptr) {
+            if (available() != 0) {
+                fail("Truncated trace.");
+            }
+            return false;
+        }
+
+        begin = next;
+        return true;
+    }
+
+  private:
+    [[noreturn]] static void fail(const std::string& message) {
+        std::cerr << message << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+
+    [[nodiscard]] std::size_t available() const {
+        return end - begin;
+    }
+
+    bool readVarint(std::uint64_t& value) {
+        const auto* next = detail::getVarint(begin, end, value);
+        if (next == nullptr) {
+            return false;
+        }
+        begin = next;
+        return true;
+    }
+
+    bool readString(std::string& value) {
+        std::uint64_t length = 0;
+        if (!readVarint(length) || available() < length) {
+            return false;
+        }
+        value.assign(begin, length);
+        begin += length;
+        return true;
+    }
+
+#ifdef _WIN32
+    std::vector<char> contents;
+#else
+    void* mapping = nullptr;
+    std::size_t mappingSize = 0;
+#endif
+    const char* begin = nullptr;
+    const char* end = nullptr;
+    Header header;
+    Decoder decoder;
+};
+} // namespace trace
+
+#endif // LOGGER_TRACE_HPP
@@ -12,6 +12,7 @@
 #include <fmt/format.h>
 
 #include <interpose.h>
+#include <interpose_new.h>
 
 namespace {
 const std::size_t kAcceptableOffset = 64;
@@ -40,7 +41,7 @@ const struct Initialization {
 
 void processEvent(size_t size, void* result) {
     static thread_local int busy = 0;
-    if (busy > 0) {
+    if (busy > 0 || interpose::insideOperator()) {
         return;
     }
     ++busy;
@@ -60,18 +61,62 @@ void processEvent(size_t size, void* result) {
 }
 } // namespace
 
+void interpose::onNew(std::size_t size, void* result, void* /*frame*/) {
+    processEvent(size, result);
+}
+
+void interpose::onDelete(void* /*pointer*/, std::size_t /*size*/,
+                         void* /*frame*/) {}
+
 extern "C" void* INTERPOSE_FUNCTION_NAME(malloc)(size_t size) {
-    static auto* next = GET_REAL_FUNCTION(malloc);
-    void* result = next(size);
+    void* result = interpose::real::malloc(size);
     processEvent(size, result);
     return result;
 }
 INTERPOSE(malloc);
 
 extern "C" void* INTERPOSE_FUNCTION_NAME(calloc)(size_t n, size_t size) {
-    static auto* next = GET_REAL_FUNCTION(calloc);
-    void* result = next(n, size);
+    void* result = interpose::real::calloc(n, size);
     processEvent(n * size, result);
     return result;
 }
 INTERPOSE(calloc);
+
+// Not recorded, but memory from the bootstrap allocator must not reach the
+// real allocator.
+extern "C" void INTERPOSE_FUNCTION_NAME(free)(void* pointer) {
+    interpose::real::free(pointer);
+}
+INTERPOSE(free);
+
+extern "C" void* INTERPOSE_FUNCTION_NAME(realloc)(void* pointer, size_t size) {
+    return interpose::real::realloc(pointer, size);
+}
+INTERPOSE(realloc);
+
+#ifndef __APPLE__
+extern "C" void* INTERPOSE_FUNCTION_NAME(reallocarray)(void* pointer, size_t n,
+                                                       size_t size) {
+    return interpose::real::reallocarray(pointer, n, size);
+}
+INTERPOSE(reallocarray);
+#endif
+
+extern "C" int INTERPOSE_FUNCTION_NAME(posix_memalign)(void** memptr,
+                                                       size_t alignment,
+                                                       size_t size) {
+    const int result = interpose::real::posix_memalign(memptr, alignment, size);
+    if (result == 0) {
+        processEvent(size, *memptr);
+    }
+    return result;
+}
+INTERPOSE(posix_memalign);
+
+extern "C" void* INTERPOSE_FUNCTION_NAME(aligned_alloc)(size_t alignment,
+                                                        size_t size) {
+    void* result = interpose::real::aligned_alloc(alignment, size);
+    processEvent(size, result);
+    return result;
+}
+INTERPOSE(aligned_alloc);
@@ -1,16 +1,22 @@
 #include <utils/perf.hpp>
 
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <cassert>
+#include <cstddef>
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
 #include <iostream>
+#include <span>
 #include <string>
 #include <utility>
 #include <vector>
 
 #include <linux/perf_event.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/syscall.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -21,6 +27,43 @@ int perf_event_open(struct perf_event_attr* attr, pid_t pid, int cpu,
     return static_cast<int>(
         syscall(SYS_perf_event_open, attr, pid, cpu, group_fd, flags));
 }
+
+#if defined(__x86_64__) || defined(__i386__)
+std::uint64_t rdpmc(std::uint32_t counter) {
+    std::uint32_t low = 0;
+    std::uint32_t high = 0;
+    asm volatile("rdpmc" : "=a"(low), "=d"(high) : "c"(counter));
+    return (static_cast<std::uint64_t>(high) << 32) | low;
+}
+
+// Follows the protocol documented in linux/perf_event.h. Returns false if the
+// counter cannot be read from user space right now: the kernel does not allow
+// it, or the event is not on a hardware counter (it is disabled, multiplexed
+// out, or a software event).
+bool readPage(const volatile perf_event_mmap_page* page,
+              std::uint64_t& value) {
+    std::uint32_t sequence = 0;
+    do {
+        sequence = page->lock;
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+
+        const auto index = page->index;
+        if (page->cap_user_rdpmc == 0 || index == 0 || page->pmc_width == 0) {
+            return false;
+        }
+        auto count = static_cast<std::int64_t>(rdpmc(index - 1));
+        // The counter is pmc_width bits wide, and signed.
+        const auto shift = 64 - page->pmc_width;
+        count = static_cast<std::int64_t>(static_cast<std::uint64_t>(count)
+                                          << shift)
+                >> shift;
+        value = static_cast<std::uint64_t>(page->offset + count);
+
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+    } while (page->lock != sequence);
+    return true;
+}
+#endif
 } // namespace
 
 std::string utils::perf::toString(std::uint32_t type, std::uint64_t config) {
@@ -135,37 +178,44 @@ utils::perf::toString(std::pair<std::uint32_t, std::uint64_t> event) {
     return toString(event.first, event.second);
 }
 
-utils::perf::Group::Group(
-    const std::vector<std::pair<std::uint32_t, std::uint64_t>>& events) {
-    assert(!events.empty());
+double utils::perf::Count::runningRatio() const {
+    return timeEnabled == 0 ? 0.0
+                            : static_cast<double>(timeRunning)
+                                  / static_cast<double>(timeEnabled);
+}
 
-    struct perf_event_attr pe; // NOLINT(cppcoreguidelines-pro-type-member-init)
-    std::memset(&pe, 0, sizeof(struct perf_event_attr));
-    pe.size = sizeof(struct perf_event_attr);
-    pe.type = events[0].first;
-    pe.config = events[0].second;
-    pe.inherit = 1;
-    pe.disabled = 1;
-
-    const auto leader = perf_event_open(&pe, 0, -1, -1, 0);
-    if (leader == -1) {
-        std::cerr << "perf_event_open failed for event "
-                  << utils::perf::toString(pe.type, pe.config) << std::endl;
-        std::exit(EXIT_FAILURE);
+std::uint64_t utils::perf::Count::scaled() const {
+    if (timeRunning == 0) {
+        return 0;
     }
-    descriptors.push_back(leader);
+    return static_cast<std::uint64_t>(
+        static_cast<double>(value) * static_cast<double>(timeEnabled)
+        / static_cast<double>(timeRunning));
+}
+
+utils::perf::Group::Group(
+    const std::vector<std::pair<std::uint32_t, std::uint64_t>>& events,
+    bool inherit)
+    : inherit(inherit) {
+    assert(!events.empty());
 
-    for (std::size_t i = 1; i < events.size(); ++i) {
+    for (std::size_t i = 0; i < events.size(); ++i) {
         struct perf_event_attr // NOLINT(cppcoreguidelines-pro-type-member-init)
             pe;
         std::memset(&pe, 0, sizeof(struct perf_event_attr));
         pe.size = sizeof(struct perf_event_attr);
         pe.type = events[i].first;
         pe.config = events[i].second;
-        pe.inherit = 1;
+        pe.inherit = inherit ? 1 : 0;
         pe.disabled = 1;
+        pe.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED
+                         | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        if (!inherit) {
+            pe.read_format |= PERF_FORMAT_GROUP;
+        }
 
-        const auto fd = perf_event_open(&pe, 0, -1, leader, 0);
+        const auto fd = perf_event_open(
+            &pe, 0, -1, descriptors.empty() ? -1 : descriptors[0], 0);
         if (fd == -1) {
             std::cerr << "perf_event_open failed for event "
                       << utils::perf::toString(pe.type, pe.config) << std::endl;
@@ -173,9 +223,25 @@ utils::perf::Group::Group(
         }
         descriptors.push_back(fd);
     }
+
+    if (inherit) {
+        return;
+    }
+    // Self-monitoring only sees the calling thread, so not inherited counts.
+    const auto pageSize = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+    for (const auto fd : descriptors) {
+        void* page = mmap(nullptr, pageSize, PROT_READ, MAP_SHARED, fd, 0);
+        pages.push_back(page == MAP_FAILED ? nullptr : page);
+    }
 }
 
 utils::perf::Group::~Group() {
+    const auto pageSize = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+    for (auto* page : pages) {
+        if (page != nullptr) {
+            munmap(page, pageSize);
+        }
+    }
     for (const auto fd : descriptors) {
         close(fd);
     }
@@ -212,20 +278,150 @@ bool utils::perf::Group::isEnabled() const {
     return enabled;
 }
 
-std::vector<std::uint64_t> utils::perf::Group::read() const {
-    // This restriction is due to `inherit` and `PERF_FORMAT_GROUP` not being
-    // compatible.
-    assert(!isEnabled());
+bool utils::perf::Group::inherits() const {
+    return inherit;
+}
+
+std::size_t utils::perf::Group::size() const {
+    return descriptors.size();
+}
+
+std::vector<utils::perf::Count> utils::perf::Group::readCounts() const {
+    std::vector<Count> counts(descriptors.size());
 
-    std::vector<std::uint64_t> values(descriptors.size());
+    if (!inherit) {
+        // { nr, time_enabled, time_running, value[nr] }, atomically for the
+        // whole group.
+        std::vector<std::uint64_t> buffer(3 + descriptors.size());
+        const auto size = buffer.size() * sizeof(std::uint64_t);
+        if (::read(descriptors[0], buffer.data(), size)
+                != static_cast<ssize_t>(size)
+            || buffer[0] != descriptors.size()) {
+            std::cerr << "read failed" << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+        for (std::size_t i = 0; i < counts.size(); ++i) {
+            counts[i] = {buffer[3 + i], buffer[1], buffer[2]};
+        }
+        return counts;
+    }
+
+    // Inherited counters cannot be read as a group, so they are read one by
+    // one, which is only consistent while they are stopped.
+    assert(!isEnabled());
 
     for (std::size_t i = 0; i < descriptors.size(); ++i) {
-        if (::read(descriptors[i], &values[i], sizeof(std::uint64_t))
-            != sizeof(std::uint64_t)) {
+        // { value, time_enabled, time_running }
+        std::array<std::uint64_t, 3> buffer{};
+        if (::read(descriptors[i], buffer.data(), sizeof(buffer))
+            != sizeof(buffer)) {
             std::cerr << "read failed" << std::endl;
             std::exit(EXIT_FAILURE);
         }
+        counts[i] = {buffer[0], buffer[1], buffer[2]};
     }
 
+    return counts;
+}
+
+std::vector<std::uint64_t> utils::perf::Group::read() const {
+    const auto counts = readCounts();
+    std::vector<std::uint64_t> values;
+    values.reserve(counts.size());
+    for (const auto& count : counts) {
+        values.push_back(count.scaled());
+    }
     return values;
 }
+
+bool utils::perf::Group::readUserSpace(std::span<std::uint64_t> values) const {
+#if defined(__x86_64__) || defined(__i386__)
+    if (pages.empty() || !enabled) {
+        return false;
+    }
+    for (std::size_t i = 0; i < pages.size(); ++i) {
+        if (pages[i] == nullptr
+            || !readPage(static_cast<const volatile perf_event_mmap_page*>(
+                             pages[i]),
+                         values[i])) {
+            return false;
+        }
+    }
+    return true;
+#else
+    static_cast<void>(values);
+    return false;
+#endif
+}
+
+void utils::perf::Group::readValues(std::span<std::uint64_t> values) const {
+    assert(values.size() == descriptors.size());
+
+    if (readUserSpace(values)) {
+        return;
+    }
+
+    if (!inherit && descriptors.size() <= kMaxFastEvents) {
+        // { nr, time_enabled, time_running, value[nr] }
+        std::array<std::uint64_t, 3 + kMaxFastEvents> buffer{};
+        const auto size = (3 + descriptors.size()) * sizeof(std::uint64_t);
+        if (::read(descriptors[0], buffer.data(), size)
+            != static_cast<ssize_t>(size)) {
+            std::cerr << "read failed" << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+        std::copy_n(buffer.begin() + 3, values.size(), values.begin());
+        return;
+    }
+
+    const auto counts = readCounts();
+    for (std::size_t i = 0; i < counts.size(); ++i) {
+        values[i] = counts[i].value;
+    }
+}
+
+utils::perf::Regions::Regions(const Group& group) : group(group) {
+    // Inheriting counters can only be read while disabled.
+    if (group.inherits()) {
+        std::cerr << "Regions need a group which does not inherit."
+                  << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+    if (group.size() > kMaxFastEvents) {
+        std::cerr << "Regions measure at most " << kMaxFastEvents
+                  << " events." << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+}
+
+std::size_t utils::perf::Regions::add(std::string name) {
+    regions.push_back(
+        {std::move(name), 0, std::vector<std::uint64_t>(group.size())});
+    return regions.size() - 1;
+}
+
+utils::perf::Regions::Scope utils::perf::Regions::measure(std::size_t region) {
+    return {*this, region};
+}
+
+const std::vector<utils::perf::Regions::Region>&
+utils::perf::Regions::get() const {
+    return regions;
+}
+
+utils::perf::Regions::Scope::Scope(Regions& regions, std::size_t region)
+    : regions(regions), region(region) {
+    regions.group.readValues(std::span(start).first(regions.group.size()));
+}
+
+utils::perf::Regions::Scope::~Scope() {
+    std::array<std::uint64_t, kMaxFastEvents> end{};
+    const auto nEvents = regions.group.size();
+    regions.group.readValues(std::span(end).first(nEvents));
+
+    auto& entry = regions.regions[region];
+    ++entry.entries;
+    for (std::size_t i = 0; i < nEvents; ++i) {
+        entry.totals[i] += end[i] - start[i];
+    }
+}